@@ -12,19 +12,77 @@
 #  define CENTROID    "./vt_centroid.bin"
 #  define WEIGHT      "./vt_weight.bin"
 #  define MODEL       "./vt_model.bin"
+#  define ITERATION_LOG "./vt_iterations.txt"
 #else
 #  define CACHE       "./ncc_cache.bin"
 #  define CENTROID    "./centroid.bin"
 #  define WEIGHT      "./weight.bin"
 #  define MODEL       "./model.bin"
+#  define ITERATION_LOG "./iterations.txt"
 #endif
 #define SUBMISSION    "./submission.txt"
+/* predict reads, predicts and writes the test data in chunks of
+   PREDICT_CHUNK documents (at most three chunks in memory) */
+#define PREDICT_CHUNK 50000
+/* predict_server predicts up to SERVER_BATCH_SIZE requests at once,
+   waiting at most SERVER_BATCH_WAIT_US for more after the first one */
+#define SERVER_BATCH_SIZE    256
+#define SERVER_BATCH_WAIT_US 500
+/* a connection sending a longer line is closed */
+#define SERVER_MAX_LINE      (1 << 20)
 
 #define VT_SEED     13
 
+/* prefetch saves a checkpoint every PREFETCH_SEGMENT documents
+   and resumes from the last one when restarted */
+#define PREFETCH_SEGMENT 100000
+
+/* 1 = write a Chrome trace of the pipeline phases to
+   <program>.trace.json (prefetch, train, predict) */
+#ifndef TRACE
+#  define TRACE 0
+#endif
+
+/* centroid search: 1 = MaxScore pruning, 0 = exhaustive (same results) */
+#define NCC_MAXSCORE   0
+
+/* binary classifier solver: 0 = SGD, LR_ITERATION epochs
+                             1 = dual coordinate descent, until LR_DUAL_EPS */
+#ifndef LR_SOLVER
+#  define LR_SOLVER    0
+#endif
+
+/* SGD training order: 0 = class by class, 1 = document major
+   (MultiClassTrainer, blocks of at most LR_BLOCK_NNZ example terms) */
+#ifndef LR_ENGINE
+#  define LR_ENGINE    0
+#endif
+#define LR_BLOCK_NNZ   (1 << 22)
+
+/* 1 = save the models with int8 weights and the centroids with a
+   compressed index (bit-packed ids, 8-bit values) and no float rows,
+   under a quarter of the float size */
+#ifndef QUANTIZED_MODEL
+#  define QUANTIZED_MODEL 0
+#endif
+
+/* 1 = validation and vt_ncc evaluate again with the quantized models
+   and print the MaF delta (about twice the run time) */
+#ifndef QUANTIZED_REPORT
+#  define QUANTIZED_REPORT 0
+#endif
+
 /* parameter for binary classifier */
 #define LR_ETA         0.2f
 #define LR_P           0.76f
 #define LR_ITERATION   40
+/* a class costing more than 1/LR_PARALLEL_SHARE of a thread's share of
+   the total training cost is trained with all threads (Hogwild SGD, the
+   weights of these classes differ from run to run) */
+#define LR_PARALLEL_SHARE 4
+/* parameter for dual coordinate descent (LR_SOLVER 1) */
+#define LR_DUAL_C         10.0f
+#define LR_DUAL_EPS       0.1f
+#define LR_DUAL_ITERATION 1000
 
 #endif
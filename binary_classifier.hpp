@@ -1,62 +1,99 @@
 #ifndef BINARY_CLASSIFIER
 #define BINARY_CLASSIFIER
 #include "util.hpp"
+#include "sparse_kernels.hpp"
 #include <cstring>
 #include <random>
 
 class BinaryClassifier
 {
 private:
-	typedef std::map<int, float> weight_t;
+	// examples are indexes into a data set shared by all classes
 	typedef std::vector<int> example_index_t;
-	typedef std::vector<fv_t> example_t;
 	
-	weight_t m_w;
+	// examples with term ids remapped to a dense local index,
+	// row i is terms[offsets[i] .. offsets[i + 1])
+	typedef struct local_example {
+		std::vector<size_t> offsets;
+		std::vector<std::pair<int, float> > terms;
+		
+		inline size_t
+		size(void) const
+		{
+			return offsets.size() - 1;
+		}
+	} local_example_t;
+	
+	// weights sorted by term id
+	std::vector<int> m_ids;
+	std::vector<float> m_weights;
 	float m_bias;
+	size_t m_iterations;
 	
-	static inline float
-	sigmoid(float x)
-	{
-		return 1.0f / (1.0f + std::exp(-x));
-	}
 	inline float
 	dot_safe(const fv_t &fv) const
 	{
 		float dot = 0.0f;
-		for (auto x = fv.begin(); x != fv.end(); ++x) {
-			auto  w = m_w.find(x->first);
-			if (w != m_w.end()) {
-				dot += x->second * w->second;
+		auto w = m_ids.begin();
+		for (auto x = fv.begin(); x != fv.end() && w != m_ids.end(); ++x) {
+			w = std::lower_bound(w, m_ids.end(), x->first);
+			if (w != m_ids.end() && *w == x->first) {
+				dot += x->second * m_weights[w - m_ids.begin()];
 			}
 		}
 		return dot;
 	}
-	inline float
-	dot(const fv_t &fv) const
+	// sorted term ids of the examples, the local index of a term is
+	// its position
+	static void
+	build_local_index(std::vector<int> &ids,
+					  const std::vector<fv_t> &data,
+					  const example_index_t &posi,
+					  const example_index_t &nega)
 	{
-		float dot = 0.0f;
-		for (auto x = fv.begin(); x != fv.end(); ++x) {
-			dot += x->second * m_w.find(x->first)->second;
+		const example_index_t *examples[2] = {&posi, &nega};
+		
+		ids.clear();
+		for (int k = 0; k < 2; ++k) {
+			for (auto i = examples[k]->begin(); i != examples[k]->end(); ++i) {
+				const fv_t &fv = data[*i];
+				for (auto x = fv.begin(); x != fv.end(); ++x) {
+					ids.push_back(x->first);
+				}
+			}
 		}
-		return dot;
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
 	}
-	void
-	reserve(const example_t &examples)
+	static void
+	localize(local_example_t &local,
+			 const std::vector<fv_t> &data,
+			 const example_index_t &examples,
+			 const std::vector<int> &ids)
 	{
-		for (auto fv = examples.begin(); fv != examples.end(); ++fv) {
-			for (auto x = fv->begin(); x != fv->end(); ++x) {
-				m_w.insert(std::make_pair(x->first, 0.0f));
+		local.offsets.assign(1, 0);
+		local.terms.clear();
+		for (auto i = examples.begin(); i != examples.end(); ++i) {
+			const fv_t &fv = data[*i];
+			auto id = ids.begin();
+			for (auto x = fv.begin(); x != fv.end(); ++x) {
+				// terms are sorted, so the search continues from the last one
+				id = std::lower_bound(id, ids.end(), x->first);
+				local.terms.push_back(std::make_pair((int)(id - ids.begin()), x->second));
 			}
+			local.offsets.push_back(local.terms.size());
 		}
 	}
-	inline void
-	update(float y, const fv_t &fv, float eta)
+	static inline void
+	update(std::vector<float> &w, float &bias,
+		   float y, const local_example_t &examples, size_t i, float eta)
 	{
-		float z = sigmoid(dot(fv) + m_bias);
-		for (auto x = fv.begin(); x != fv.end(); ++x) {
-			m_w.find(x->first)->second -= eta * (z - y) * x->second;
-		}
-		m_bias -= eta * (z - y);
+		const std::pair<int, float> *x = examples.terms.data() + examples.offsets[i];
+		size_t n = examples.offsets[i + 1] - examples.offsets[i];
+		float z = fast_sigmoid(sparse_dot(w.data(), x, n) + bias);
+		
+		sparse_axpy(w.data(), -eta * (z - y), x, n);
+		bias -= eta * (z - y);
 	}
 	inline float
 	uniform(std::mt19937 &rng)
@@ -71,74 +108,307 @@ private:
 		return dist(rng);
 	}
 	void
-	initialize(const example_t &posi, const example_t &nega)
+	sgd(std::vector<float> &w, float &bias,
+		const local_example_t &local_posi, const local_example_t &local_nega,
+		float eta, float p, size_t iteration, size_t steps,
+		std::mt19937 &rng)
 	{
-		m_w.clear();
-		m_bias = 0.0f;
-		reserve(posi);
-		reserve(nega);
+		for (size_t i = 0; i < iteration; ++i) {
+			float learning_rate = eta / (1.0f + (float)i / iteration);
+			for (size_t j = 0; j < steps; ++j) {
+				if (uniform(rng) < p) {
+					size_t k = random_index(local_posi.size(), rng);
+					update(w, bias, 1.0f, local_posi, k, learning_rate);
+				} else {
+					size_t k = random_index(local_nega.size(), rng);
+					update(w, bias, 0.0f, local_nega, k, learning_rate);
+				}
+			}
+		}
+	}
+	// example i of posi followed by nega, returns its label (1 = posi)
+	static inline int
+	example(const local_example_t *examples[2], size_t posi_size, size_t i,
+			const std::pair<int, float> *&begin, const std::pair<int, float> *&end)
+	{
+		int k = i < posi_size ? 1 : 0;
+		const local_example_t &ex = *examples[k];
+		size_t row = k ? i : i - posi_size;
+		
+		begin = ex.terms.data() + ex.offsets[row];
+		end = ex.terms.data() + ex.offsets[row + 1];
+		
+		return k;
+	}
+	// keeps the nonzero weights, mapped back to global term ids
+	void
+	set_weights(const std::vector<int> &ids, const std::vector<float> &w)
+	{
+		m_ids.clear();
+		m_weights.clear();
+		for (size_t i = 0; i < ids.size(); ++i) {
+			if (w[i] > 0.0f || w[i] < 0.0f) {
+				m_ids.push_back(ids[i]);
+				m_weights.push_back(w[i]);
+			}
+		}
 	}
 
 public:
 	BinaryClassifier(std::map<int, float> &ws, float bias)
 	{
-		m_w = ws;
+		for (auto w = ws.begin(); w != ws.end(); ++w) {
+			m_ids.push_back(w->first);
+			m_weights.push_back(w->second);
+		}
 		m_bias = bias;
+		m_iterations = 0;
 	}
-	BinaryClassifier(const BinaryClassifier &rhs)
+	BinaryClassifier() : m_bias(0.0f), m_iterations(0)
 	{
-		m_w = rhs.m_w;
-		m_bias = rhs.bias();
 	}
-	BinaryClassifier()
+	// posi and nega are indexes of the positive and negative examples in data.
+	// threads > 1 trains this one class in parallel (for the large classes).
+	// The parallel result is not deterministic: the threads update the
+	// shared weights without locking (Hogwild), so it depends on how their
+	// steps interleave. threads = 1 always gives the same model.
+	void
+	train(const std::vector<fv_t> &data,
+		  const example_index_t &posi, const example_index_t &nega,
+		  float eta, float p, size_t iteration, int threads = 1)
 	{
+		std::vector<int> ids;
+		std::vector<float> w;
+		local_example_t local_posi;
+		local_example_t local_nega;
+		
+		build_local_index(ids, data, posi, nega);
+		w.assign(ids.size(), 0.0f);
+		m_bias = 0.0f;
+		m_iterations = 0;
+		if (posi.size() == 0) {
+			m_bias = -1.0f;
+		} else if (nega.size() == 0) {
+			m_bias = 1.0f;
+		} else {
+			size_t examples = (posi.size() + nega.size());
+			
+			m_iterations = iteration;
+			localize(local_posi, data, posi, ids);
+			localize(local_nega, data, nega, ids);
+#ifndef _OPENMP
+			threads = 1;
+#endif
+			if (threads > 1) {
+				// Hogwild: the threads share w and update it without
+				// locking, each runs 1/threads of the steps. a lost update
+				// of one of the many sparse weights is harmless, but every
+				// step updates the bias, so each thread fits its own bias
+				// against the shared w and they are averaged at the end.
+				size_t steps = (examples + threads - 1) / threads;
+				std::vector<float> biases(threads, 0.0f);
+				int team = 1; // fewer than threads in a nested region
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads)
+#endif
+				{
+					int id = processor_id();
+					std::mt19937 rng(std::mt19937::default_seed + id);
+					float bias = 0.0f;
+					sgd(w, bias, local_posi, local_nega, eta, p, iteration, steps, rng);
+					biases[id] = bias;
+#ifdef _OPENMP
+					if (id == 0) {
+						team = omp_get_num_threads();
+					}
+#endif
+				}
+				for (auto bias = biases.begin(); bias != biases.end(); ++bias) {
+					m_bias += *bias;
+				}
+				m_bias /= team;
+			} else {
+				std::mt19937 rng;
+				sgd(w, m_bias, local_posi, local_nega, eta, p, iteration, examples, rng);
+			}
+		}
+		set_weights(ids, w);
 	}
+	// dual coordinate descent for L2-regularized logistic regression
+	// (Yu, Huang and Lin 2011, the LIBLINEAR solver). the bias is a
+	// feature of value 1. the classes are weighted like the SGD sampling,
+	// p for the positives and 1 - p for the negatives. stops when the
+	// largest dual gradient of an epoch is below eps.
+	// no shrinking: the bound test of the SVM dual (PGmax/PGmin) never
+	// fires, since log(alpha / (C - alpha)) keeps every alpha strictly
+	// inside (0, C), and LIBLINEAR's solve_l2r_lr_dual does not shrink
+	// either. shrinking the variables that get no newton step took more
+	// epochs and more time than it saved.
 	void
-	train(const example_t &posi, const example_t &nega,
-		  float eta, float p, size_t iteration)
+	train_dual(const std::vector<fv_t> &data,
+			   const example_index_t &posi, const example_index_t &nega,
+			   float p, float c, float eps, size_t max_iteration)
 	{
-		std::mt19937 rng;
-		initialize(posi, nega);
+		std::vector<int> ids;
+		std::vector<double> w;
+		double bias = 0.0;
+		local_example_t local_posi;
+		local_example_t local_nega;
+		
+		build_local_index(ids, data, posi, nega);
+		w.assign(ids.size(), 0.0);
+		m_bias = 0.0f;
+		m_iterations = 0;
 		if (posi.size() == 0) {
 			m_bias = -1.0f;
 		} else if (nega.size() == 0) {
 			m_bias = 1.0f;
 		} else {
-			size_t count = 0;
-			size_t examples = (posi.size() + nega.size());
-			for (size_t i = 0; i < iteration; ++i) {
-				float learning_rate = eta / (1.0f + (float)i / iteration);
-				for (size_t j = 0; j < examples; ++j) {
-					if (uniform(rng) < p) {
-						size_t k = random_index(posi.size(), rng);
-						update(1.0f, posi[k], learning_rate);
+			const local_example_t *examples[2] = {&local_nega, &local_posi};
+			const double max_inner_iteration = 100;
+			const size_t l = posi.size() + nega.size();
+			const double upper[2] = {
+				(double)c * l * (1.0 - p) / nega.size(),
+				(double)c * l * p / posi.size()
+			};
+			std::vector<double> alpha(l * 2);
+			std::vector<double> xx(l);
+			std::vector<size_t> index(l);
+			double innereps = 1e-2;
+			double innereps_min = std::min(1e-8, (double)eps);
+			std::mt19937 rng;
+			
+			localize(local_posi, data, posi, ids);
+			localize(local_nega, data, nega, ids);
+			for (size_t i = 0; i < l; ++i) {
+				const std::pair<int, float> *begin, *end;
+				int k = example(examples, posi.size(), i, begin, end);
+				double y = k ? 1.0 : -1.0;
+				
+				alpha[2 * i] = std::min(0.001 * upper[k], 1e-8);
+				alpha[2 * i + 1] = upper[k] - alpha[2 * i];
+				xx[i] = 1.0;
+				for (const std::pair<int, float> *x = begin; x != end; ++x) {
+					xx[i] += x->second * x->second;
+					w[x->first] += y * alpha[2 * i] * x->second;
+				}
+				bias += y * alpha[2 * i];
+				index[i] = i;
+			}
+			while (m_iterations < max_iteration) {
+				size_t newton_iteration = 0;
+				double gmax = 0.0;
+				
+				std::shuffle(index.begin(), index.end(), rng);
+				for (size_t s = 0; s < l; ++s) {
+					const std::pair<int, float> *begin, *end;
+					size_t i = index[s];
+					int k = example(examples, posi.size(), i, begin, end);
+					double y = k ? 1.0 : -1.0;
+					double C = upper[k];
+					double ywx = bias;
+					size_t ind1, ind2;
+					double sign;
+					
+					for (const std::pair<int, float> *x = begin; x != end; ++x) {
+						ywx += w[x->first] * x->second;
+					}
+					ywx *= y;
+					// minimizes over the smaller of alpha_i and C - alpha_i
+					if (0.5 * xx[i] * (alpha[2 * i + 1] - alpha[2 * i]) + ywx < 0.0) {
+						ind1 = 2 * i + 1;
+						ind2 = 2 * i;
+						sign = -1.0;
 					} else {
-						size_t k = random_index(nega.size(), rng);
-						update(0.0f, nega[k], learning_rate);
+						ind1 = 2 * i;
+						ind2 = 2 * i + 1;
+						sign = 1.0;
+					}
+					double alpha_old = alpha[ind1];
+					double z = alpha_old;
+					if (C - z < 0.5 * C) {
+						z = 0.1 * z;
 					}
-					++count;
+					double gp = xx[i] * (z - alpha_old) + sign * ywx + std::log(z / (C - z));
+					gmax = std::max(gmax, std::fabs(gp));
+					
+					// newton method on the one variable sub-problem
+					int inner_iteration = 0;
+					while (inner_iteration <= max_inner_iteration
+						   && std::fabs(gp) >= innereps)
+					{
+						double gpp = xx[i] + C / (C - z) / z;
+						double tmpz = z - gp / gpp;
+						if (tmpz <= 0.0) {
+							z *= 0.1;
+						} else {
+							z = tmpz;
+						}
+						gp = xx[i] * (z - alpha_old) + sign * ywx + std::log(z / (C - z));
+						++newton_iteration;
+						++inner_iteration;
+					}
+					if (inner_iteration > 0) {
+						double d = sign * (z - alpha_old) * y;
+						alpha[ind1] = z;
+						alpha[ind2] = C - z;
+						for (const std::pair<int, float> *x = begin; x != end; ++x) {
+							w[x->first] += d * x->second;
+						}
+						bias += d;
+					}
+				}
+				++m_iterations;
+				if (gmax < eps) {
+					break;
+				}
+				if (newton_iteration <= l / 10) {
+					innereps = std::max(innereps_min, 0.1 * innereps);
 				}
 			}
+			m_bias = (float)bias;
 		}
+		set_weights(ids, std::vector<float>(w.begin(), w.end()));
+	}
+	// sets the weights of sorted term ids, trained elsewhere
+	void
+	set(const std::vector<int> &ids, const std::vector<float> &w,
+		float bias, size_t iterations)
+	{
+		set_weights(ids, w);
+		m_bias = bias;
+		m_iterations = iterations;
+	}
+	// epochs used by the last train
+	size_t
+	iterations(void) const
+	{
+		return m_iterations;
 	}
 	size_t
 	size(void) const
 	{
 		size_t nonzero_count = 0;
-		for (weight_t::const_iterator w =  m_w.begin(); w != m_w.end(); ++w) {
-			if (w->second > 0.0f || w->second < 0.0f) {
+		for (auto w = m_weights.begin(); w != m_weights.end(); ++w) {
+			if (*w > 0.0f || *w < 0.0f) {
 				nonzero_count += 1;
 			}
 		}
 		return nonzero_count;
 	}
+	// heap bytes of the weights
+	size_t
+	memory_usage(void) const
+	{
+		return ::memory_usage(m_ids) + ::memory_usage(m_weights);
+	}
 	void
 	nonzero_weights(std::map<int, float> &ws) const
 	{
 		ws.clear();
-		for (weight_t::const_iterator w = m_w.begin(); w != m_w.end(); ++w) {
-			if (w->second > 0.0f || w->second < 0.0f) {
-				ws.insert(std::make_pair(w->first, w->second));
+		for (size_t i = 0; i < m_ids.size(); ++i) {
+			if (m_weights[i] > 0.0f || m_weights[i] < 0.0f) {
+				ws.insert(std::make_pair(m_ids[i], m_weights[i]));
 			}
 		}
 	}
@@ -2,85 +2,195 @@
 #define CLASSIFIER_STORAGE_HPP
 
 #include "binary_classifier.hpp"
+#include "mapped_file.hpp"
+#include "sparse_kernels.hpp"
 #include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
 
 // Storage for Binary Classifier
+//
+// Model file written by save() and mapped by load():
+//
+// header
+// category_ids  int32_t[models], sorted
+// biases        float[models]
+// offsets       uint64_t[models + 1]
+// weight_ids    int32_t[nnz], sorted in each model
+// weights       float[nnz], or int8_t[nnz] when quantized
+// slots         int32_t[slot_size], model index of a category id or -1
+// scales        float[models], when quantized
+//
+// slots is a dense category id -> model table (omitted when the ids are
+// too sparse, then category_ids is binary searched).
+// A quantized model stores each weight as q * scale of its model, with
+// int8 q (save(file, true) or quantize()), a quarter of the float size.
+// Files of version 1 and of the old format (per-weight records) are
+// still read.
+// load() checks that the sections are within the file, the offsets are
+// nondecreasing and end at nnz, the ids are sorted and the slots point
+// to their own models, since predict() trusts them.
+//
+// build_term_index() transposes the loaded models into a term ->
+// (model, weight) index, so that predict() with a ScoreContext scores
+// all candidate categories of a query in one pass over its terms.
 class ClassifierStorage
 {
+public:
+	static const uint32_t VERSION = 2;
+	static const uint32_t FLAG_QUANTIZED = 1;
+	
+	typedef struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t flags;
+		uint64_t models;
+		uint64_t nnz;
+		uint64_t slot_size;
+		uint64_t category_ids;
+		uint64_t biases;
+		uint64_t offsets;
+		uint64_t weight_ids;
+		uint64_t weights;
+		uint64_t slots;
+		uint64_t scales;
+	} header_t;
+
+	// Work area for predict() of many candidates.
+	// Each thread should hold its own context and reuse it.
+	class ScoreContext
+	{
+		friend class ClassifierStorage;
+		
+		// candidate position of a model, or -1
+		std::vector<int32_t> m_position;
+		std::vector<int32_t> m_models;
+		std::vector<float> m_scores;
+	public:
+		ScoreContext() {}
+	};
+
 private:
+	// a term list at most this many times longer than the candidates
+	// is scanned, longer lists are binary searched for each candidate
+	static const size_t SCAN_RATIO = 16;
+	
+	// classifiers given by set(), per thread until freeze()
+	typedef std::pair<int, BinaryClassifier> entry_t;
 	std::map<int, BinaryClassifier> m_classifiers;
+	ThreadBuffer<entry_t> m_pending;
 	
-public:
-	ClassifierStorage(){}
+	// loaded models. the arrays point into m_file, or into the
+	// buffers below for files of the old format.
+	MappedFile m_file;
+	MappedArray<int32_t> m_category_ids;
+	MappedArray<float> m_biases;
+	MappedArray<uint64_t> m_offsets;
+	MappedArray<int32_t> m_weight_ids;
+	MappedArray<float> m_weights;
+	MappedArray<int32_t> m_slots;
+	MappedArray<int8_t> m_qweights;
+	MappedArray<float> m_scales;
+	bool m_quantized;
+	std::vector<int32_t> m_category_id_buffer;
+	std::vector<float> m_bias_buffer;
+	std::vector<uint64_t> m_offset_buffer;
+	std::vector<int32_t> m_weight_id_buffer;
+	std::vector<float> m_weight_buffer;
+	std::vector<int32_t> m_slot_buffer;
+	std::vector<int8_t> m_qweight_buffer;
+	std::vector<float> m_scale_buffer;
+	// term index: the models with a weight for term t are
+	// m_term_models[m_term_offsets[t] .. m_term_offsets[t + 1]), sorted
+	std::vector<uint64_t> m_term_offsets;
+	std::vector<int32_t> m_term_models;
+	std::vector<float> m_term_weights;
+	std::vector<int8_t> m_term_qweights;
 	
-	void
-	set(unsigned int category_id,
-		BinaryClassifier &classifier)
+	static void
+	set_magic(char *magic)
 	{
-#ifdef _OPENMP
-#pragma omp critical (classifier_storage)
-#endif
-		{
-			m_classifiers.insert(std::make_pair(category_id, classifier));
-		}
+		std::memcpy(magic, "LSHTCLRM", 8);
 	}
 	
-	const BinaryClassifier *
-	get(unsigned int category_id) const
+	inline int
+	slot(unsigned int category_id) const
 	{
-		const BinaryClassifier *classifier = 0;
-#ifdef _OPENMP
-#pragma omp critical (classifier_storage)
-#endif
-		{
-			auto i = m_classifiers.find(category_id);
-			if (i != m_classifiers.end()) {
-				classifier = &i->second;
+		if (!m_slots.empty()) {
+			return category_id < m_slots.size() ? m_slots[category_id] : -1;
+		} else {
+			const int32_t *i = std::lower_bound(m_category_ids.begin(),
+												m_category_ids.end(),
+												(int32_t)category_id);
+			if (i != m_category_ids.end() && *i == (int32_t)category_id) {
+				return (int)(i - m_category_ids.begin());
 			}
+			return -1;
 		}
-		return classifier;
 	}
-	bool
-	save(const char *file) const
+	
+	// dense table when it is at most a few times larger than the ids
+	static void
+	build_slots(std::vector<int32_t> &slots,
+				const std::vector<int32_t> &category_ids)
 	{
-		FILE *fp = std::fopen(file, "wb");
-		if (fp == 0) {
-			return false;
-		}
-		size_t size = m_classifiers.size();
-		std::fwrite(&size, sizeof(size), 1, fp);
-		
-		for (auto classifier = m_classifiers.begin();
-			 classifier != m_classifiers.end(); ++classifier)
+		slots.clear();
+		if (!category_ids.empty() && category_ids.front() >= 0
+			&& (size_t)category_ids.back() < category_ids.size() * 4 + 65536)
 		{
-			int category_id = classifier->first;
-			std::map<int, float> ws;
-			float bias = classifier->second.bias();
-			classifier->second.nonzero_weights(ws);
-			
-			size = ws.size();
-			fwrite(&category_id, sizeof(category_id), 1, fp);
-			fwrite(&size, sizeof(size), 1, fp);
-			//printf("category_id: %d, %ld\n", category_id, size);
-			for (auto w = ws.begin(); w != ws.end(); ++w) {
-				fwrite(&w->first, sizeof(w->first), 1, fp);
-				fwrite(&w->second, sizeof(w->second), 1, fp);
+			slots.assign(category_ids.back() + 1, -1);
+			for (size_t i = 0; i < category_ids.size(); ++i) {
+				slots[category_ids[i]] = (int32_t)i;
 			}
-			fwrite(&bias, sizeof(bias), 1, fp);
 		}
-		fclose(fp);
-		
-		return true;
 	}
+	
+	void
+	use_buffers(void)
+	{
+		m_category_ids.set(m_category_id_buffer);
+		m_biases.set(m_bias_buffer);
+		m_offsets.set(m_offset_buffer);
+		m_weight_ids.set(m_weight_id_buffer);
+		m_weights.set(m_weight_buffer);
+		m_slots.set(m_slot_buffer);
+		m_qweights.set(m_qweight_buffer);
+		m_scales.set(m_scale_buffer);
+	}
+	
+	void
+	clear(void)
+	{
+		std::vector<entry_t> pending;
+		m_pending.drain(pending);
+		m_classifiers.clear();
+		m_file.close();
+		m_category_id_buffer.clear();
+		m_bias_buffer.clear();
+		m_offset_buffer.assign(1, 0);
+		m_weight_id_buffer.clear();
+		m_weight_buffer.clear();
+		m_slot_buffer.clear();
+		m_qweight_buffer.clear();
+		m_scale_buffer.clear();
+		m_quantized = false;
+		m_term_offsets.clear();
+		m_term_models.clear();
+		m_term_weights.clear();
+		m_term_qweights.clear();
+		use_buffers();
+	}
+	
+	// old format: per-weight records
 	bool
-	load(const char *file)
+	load_records(const char *file)
 	{
 		FILE *fp = std::fopen(file, "rb");
 		
 		if (fp == 0) {
 			return false;
 		}
-		m_classifiers.clear();
 		size_t classifier_num = 0;
 		size_t ret = std::fread(&classifier_num, sizeof(classifier_num), 1, fp);
 		if (ret != 1) {
@@ -101,7 +211,6 @@ public:
 				return false;
 			}
 			ret = fread(&vec_size, sizeof(vec_size), 1, fp);
-			//printf("category_id: %d, %ld\n", category_id, vec_size);
 			if (ret != 1) {
 				std::fprintf(stderr, "ClassifierStorage: %s: invalid format 3\n", file);
 				fclose(fp);
@@ -135,6 +244,535 @@ public:
 		}
 		fclose(fp);
 		
+		flatten(m_category_id_buffer, m_bias_buffer, m_offset_buffer,
+				m_weight_id_buffer, m_weight_buffer);
+		build_slots(m_slot_buffer, m_category_id_buffer);
+		m_classifiers.clear();
+		use_buffers();
+		
+		return true;
+	}
+	
+	// classifiers given by set() as flat arrays
+	void
+	flatten(std::vector<int32_t> &category_ids,
+			std::vector<float> &biases,
+			std::vector<uint64_t> &offsets,
+			std::vector<int32_t> &weight_ids,
+			std::vector<float> &weights) const
+	{
+		category_ids.clear();
+		biases.clear();
+		offsets.assign(1, 0);
+		weight_ids.clear();
+		weights.clear();
+		for (auto classifier = m_classifiers.begin();
+			 classifier != m_classifiers.end(); ++classifier)
+		{
+			std::map<int, float> ws;
+			classifier->second.nonzero_weights(ws);
+			category_ids.push_back(classifier->first);
+			biases.push_back(classifier->second.bias());
+			for (auto w = ws.begin(); w != ws.end(); ++w) {
+				weight_ids.push_back(w->first);
+				weights.push_back(w->second);
+			}
+			offsets.push_back(weight_ids.size());
+		}
+	}
+	
+	// symmetric int8 quantization with a scale per model
+	static void
+	quantize_weights(std::vector<float> &scales,
+					 std::vector<int8_t> &qweights,
+					 const uint64_t *offsets, size_t models,
+					 const float *weights)
+	{
+		scales.assign(models, 0.0f);
+		qweights.resize(offsets[models]);
+		for (size_t i = 0; i < models; ++i) {
+			float max_weight = 0.0f;
+			for (uint64_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+				max_weight = std::max(max_weight, std::fabs(weights[j]));
+			}
+			scales[i] = max_weight / 127.0f;
+			for (uint64_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+				int q = scales[i] > 0.0f ? (int)std::floor(weights[j] / scales[i] + 0.5f) : 0;
+				qweights[j] = (int8_t)std::max(-127, std::min(127, q));
+			}
+		}
+	}
+	
+	// dot of model i and fv, weights are m_weights or m_qweights
+	template<typename T>
+	inline float
+	model_dot(int i, const fv_t &fv, const T *weights) const
+	{
+		const int32_t *begin = m_weight_ids.data() + m_offsets[i];
+		const int32_t *end = m_weight_ids.data() + m_offsets[i + 1];
+		float dot = 0.0f;
+		
+		for (auto x = fv.begin(); x != fv.end() && begin != end; ++x) {
+			begin = std::lower_bound(begin, end, (int32_t)x->first);
+			if (begin != end && *begin == x->first) {
+				dot += x->second * weights[begin - m_weight_ids.data()];
+			}
+		}
+		return dot;
+	}
+	
+	// the same for int8 weights: the matching weights are collected in
+	// blocks and summed with the gather kernel
+	inline float
+	model_dot(int i, const fv_t &fv, const int8_t *weights) const
+	{
+		static const size_t BLOCK = 64;
+		const int32_t *first = m_weight_ids.data() + m_offsets[i];
+		const int32_t *begin = first;
+		const int32_t *end = m_weight_ids.data() + m_offsets[i + 1];
+		const int8_t *w = weights + m_offsets[i];
+		sparse_element_t block[BLOCK];
+		size_t n = 0;
+		float dot = 0.0f;
+		
+		for (auto x = fv.begin(); x != fv.end() && begin != end; ++x) {
+			begin = std::lower_bound(begin, end, (int32_t)x->first);
+			if (begin != end && *begin == x->first) {
+				block[n++] = sparse_element_t((int)(begin - first), x->second);
+				if (n == BLOCK) {
+					dot += sparse_dot_i8(w, end - first, block, n);
+					n = 0;
+				}
+			}
+		}
+		return dot + sparse_dot_i8(w, end - first, block, n);
+	}
+	
+	// scores[position[m]] += a * w for the (model m, weight w) entries of
+	// a term, the int8 weights with the scatter kernel
+	static inline void
+	add_term(std::vector<float> &scores, const std::vector<int32_t> &position,
+			 const int32_t *models, const float *weights, float a, size_t n)
+	{
+		for (size_t j = 0; j < n; ++j) {
+			int32_t k = position[models[j]];
+			if (k >= 0) {
+				scores[k] += a * weights[j];
+			}
+		}
+	}
+	static inline void
+	add_term(std::vector<float> &scores, const std::vector<int32_t> &position,
+			 const int32_t *models, const int8_t *weights, float a, size_t n)
+	{
+		sparse_scatter_add_i8(scores.data(), position.data(), models, weights, a, n);
+	}
+	
+	// adds the term index weights of fv to the scores of the candidates
+	template<typename T>
+	inline void
+	accumulate(ScoreContext &context, const fv_t &fv, const T *weights) const
+	{
+		const std::vector<int32_t> &position = context.m_position;
+		const std::vector<int32_t> &models = context.m_models;
+		std::vector<float> &scores = context.m_scores;
+		
+		for (auto x = fv.begin(); x != fv.end(); ++x) {
+			if (x->first < 0 || x->first + 1 >= (int)m_term_offsets.size()) {
+				continue;
+			}
+			const int32_t *begin = m_term_models.data() + m_term_offsets[x->first];
+			const int32_t *end = m_term_models.data() + m_term_offsets[x->first + 1];
+			
+			if ((size_t)(end - begin) <= models.size() * SCAN_RATIO) {
+				add_term(scores, position, begin, weights + (begin - m_term_models.data()),
+						 x->second, end - begin);
+			} else {
+				for (size_t k = 0; k < models.size(); ++k) {
+					const int32_t *m = std::lower_bound(begin, end, models[k]);
+					if (m != end && *m == models[k]) {
+						scores[k] += x->second * weights[m - m_term_models.data()];
+					}
+				}
+			}
+		}
+	}
+
+public:
+	ClassifierStorage()
+	{
+		clear();
+	}
+	
+	// may be called from many threads, does not lock
+	void
+	set(unsigned int category_id,
+		BinaryClassifier &classifier)
+	{
+		m_pending.push_back(entry_t(category_id, classifier));
+	}
+	
+	// merges the classifiers given by set()
+	void
+	freeze(void)
+	{
+		std::vector<entry_t> entries;
+		m_pending.drain(entries);
+		for (auto entry = entries.begin(); entry != entries.end(); ++entry) {
+			m_classifiers.insert(*entry);
+		}
+	}
+	
+	// score of the loaded model of category_id for fv.
+	// returns false when there is no model.
+	inline bool
+	predict(unsigned int category_id, const fv_t &fv, float &value) const
+	{
+		int i = slot(category_id);
+		
+		if (i < 0) {
+			return false;
+		}
+		if (m_quantized) {
+			value = model_dot(i, fv, m_qweights.data()) * m_scales[i] + m_biases[i];
+		} else {
+			value = model_dot(i, fv, m_weights.data()) + m_biases[i];
+		}
+		
+		return true;
+	}
+	
+	// builds the term index of the loaded models
+	void
+	build_term_index(void)
+	{
+		int32_t max_term = -1;
+		std::vector<uint64_t> pos;
+		
+		for (auto id = m_weight_ids.begin(); id != m_weight_ids.end(); ++id) {
+			max_term = std::max(max_term, *id);
+		}
+		m_term_offsets.assign(max_term + 2, 0);
+		for (auto id = m_weight_ids.begin(); id != m_weight_ids.end(); ++id) {
+			if (*id >= 0) {
+				m_term_offsets[*id + 1] += 1;
+			}
+		}
+		for (size_t t = 0; t + 1 < m_term_offsets.size(); ++t) {
+			m_term_offsets[t + 1] += m_term_offsets[t];
+		}
+		m_term_models.resize(m_term_offsets.back());
+		m_term_weights.clear();
+		m_term_qweights.clear();
+		if (m_quantized) {
+			m_term_qweights.resize(m_term_offsets.back());
+		} else {
+			m_term_weights.resize(m_term_offsets.back());
+		}
+		pos.assign(m_term_offsets.begin(), m_term_offsets.end() - 1);
+		for (size_t i = 0; i < m_category_ids.size(); ++i) {
+			for (uint64_t j = m_offsets[i]; j < m_offsets[i + 1]; ++j) {
+				if (m_weight_ids[j] >= 0) {
+					uint64_t p = pos[m_weight_ids[j]]++;
+					m_term_models[p] = (int32_t)i;
+					if (m_quantized) {
+						m_term_qweights[p] = m_qweights[j];
+					} else {
+						m_term_weights[p] = m_weights[j];
+					}
+				}
+			}
+		}
+	}
+	
+	// scores of the loaded models of category_ids for fv, the same values
+	// as predict() of each category. values are (score, category id)
+	// of the categories that have a model.
+	// uses the term index when it is built.
+	void
+	predict(ScoreContext &context,
+			std::vector<std::pair<float, int> > &values,
+			const std::vector<int> &category_ids,
+			const fv_t &fv) const
+	{
+		std::vector<int32_t> &position = context.m_position;
+		std::vector<int32_t> &models = context.m_models;
+		std::vector<float> &scores = context.m_scores;
+		
+		values.clear();
+		if (m_term_offsets.empty()) {
+			for (auto c = category_ids.begin(); c != category_ids.end(); ++c) {
+				float value;
+				if (predict(*c, fv, value)) {
+					values.push_back(std::make_pair(value, *c));
+				}
+			}
+			return;
+		}
+		if (position.size() < m_category_ids.size()) {
+			position.resize(m_category_ids.size(), -1);
+		}
+		models.clear();
+		for (auto c = category_ids.begin(); c != category_ids.end(); ++c) {
+			int i = slot(*c);
+			if (i >= 0 && position[i] < 0) {
+				position[i] = (int32_t)models.size();
+				models.push_back(i);
+			}
+		}
+		scores.assign(models.size(), 0.0f);
+		if (m_quantized) {
+			accumulate(context, fv, m_term_qweights.data());
+		} else {
+			accumulate(context, fv, m_term_weights.data());
+		}
+		for (size_t k = 0; k < models.size(); ++k) {
+			float scale = m_quantized ? m_scales[models[k]] : 1.0f;
+			values.push_back(std::make_pair(scores[k] * scale + m_biases[models[k]],
+											m_category_ids[models[k]]));
+			position[models[k]] = -1;
+		}
+	}
+	
+	// converts the loaded weights to int8 (see quantize_weights()),
+	// the scores change by the quantization error
+	void
+	quantize(void)
+	{
+		if (m_quantized) {
+			return;
+		}
+		quantize_weights(m_scale_buffer, m_qweight_buffer,
+						 m_offsets.data(), m_category_ids.size(), m_weights.data());
+		m_qweights.set(m_qweight_buffer);
+		m_scales.set(m_scale_buffer);
+		m_weights.set(0, 0);
+		std::vector<float>().swap(m_weight_buffer);
+		m_quantized = true;
+		if (!m_term_offsets.empty()) {
+			build_term_index();
+		}
+	}
+	bool
+	quantized(void) const
+	{
+		return m_quantized;
+	}
+	
+	size_t
+	size(void) const
+	{
+		return m_classifiers.empty() ? m_category_ids.size() : m_classifiers.size();
+	}
+	// classifiers (map nodes and weights), flat buffers, term index,
+	// or the mapped model file
+	size_t
+	memory_usage(void) const
+	{
+		size_t bytes = m_file.size();
+		
+		for (auto i = m_classifiers.begin(); i != m_classifiers.end(); ++i) {
+			bytes += tree_node_bytes(sizeof(entry_t)) + i->second.memory_usage();
+		}
+		bytes += m_pending.memory_usage([](const entry_t &entry) {
+			return entry.second.memory_usage();
+		});
+		bytes += ::memory_usage(m_category_id_buffer)
+			+ ::memory_usage(m_bias_buffer)
+			+ ::memory_usage(m_offset_buffer)
+			+ ::memory_usage(m_weight_id_buffer)
+			+ ::memory_usage(m_weight_buffer)
+			+ ::memory_usage(m_slot_buffer)
+			+ ::memory_usage(m_qweight_buffer)
+			+ ::memory_usage(m_scale_buffer);
+		bytes += ::memory_usage(m_term_offsets)
+			+ ::memory_usage(m_term_models)
+			+ ::memory_usage(m_term_weights)
+			+ ::memory_usage(m_term_qweights);
+		
+		return bytes;
+	}
+	
+	// saves the classifiers given by set(), or the loaded models.
+	// the weights are quantized when quantized is true, a quantized
+	// model is always saved quantized.
+	bool
+	save(const char *file, bool quantized = false)
+	{
+		header_t header;
+		std::vector<int32_t> category_ids;
+		std::vector<float> biases;
+		std::vector<uint64_t> offsets;
+		std::vector<int32_t> weight_ids;
+		std::vector<float> weights;
+		std::vector<int32_t> slots;
+		std::vector<int8_t> qweights;
+		std::vector<float> scales;
+		size_t weight_size;
+		bool ok = true;
+		
+		freeze();
+		if (m_classifiers.empty()) {
+			category_ids.assign(m_category_ids.begin(), m_category_ids.end());
+			biases.assign(m_biases.begin(), m_biases.end());
+			offsets.assign(m_offsets.begin(), m_offsets.end());
+			weight_ids.assign(m_weight_ids.begin(), m_weight_ids.end());
+			if (m_quantized) {
+				qweights.assign(m_qweights.begin(), m_qweights.end());
+				scales.assign(m_scales.begin(), m_scales.end());
+				quantized = true;
+			} else {
+				weights.assign(m_weights.begin(), m_weights.end());
+			}
+		} else {
+			flatten(category_ids, biases, offsets, weight_ids, weights);
+		}
+		if (quantized && !weights.empty()) {
+			quantize_weights(scales, qweights, offsets.data(), category_ids.size(), weights.data());
+			std::vector<float>().swap(weights);
+		} else if (quantized) {
+			scales.resize(category_ids.size(), 0.0f);
+		}
+		build_slots(slots, category_ids);
+		weight_size = quantized ? sizeof(int8_t) : sizeof(float);
+		
+		std::memset(&header, 0, sizeof(header));
+		set_magic(header.magic);
+		header.version = VERSION;
+		header.flags = quantized ? FLAG_QUANTIZED : 0;
+		header.models = category_ids.size();
+		header.nnz = weight_ids.size();
+		header.slot_size = slots.size();
+		header.category_ids = MappedFile::align8(sizeof(header));
+		header.biases = MappedFile::align8(header.category_ids + category_ids.size() * sizeof(int32_t));
+		header.offsets = MappedFile::align8(header.biases + biases.size() * sizeof(float));
+		header.weight_ids = MappedFile::align8(header.offsets + offsets.size() * sizeof(uint64_t));
+		header.weights = MappedFile::align8(header.weight_ids + weight_ids.size() * sizeof(int32_t));
+		header.slots = MappedFile::align8(header.weights + weight_ids.size() * weight_size);
+		header.scales = MappedFile::align8(header.slots + slots.size() * sizeof(int32_t));
+		
+		FILE *fp = std::fopen(file, "wb");
+		if (fp == 0) {
+			return false;
+		}
+		ok &= std::fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok &= MappedFile::write_padding(fp, sizeof(header));
+		ok &= std::fwrite(category_ids.data(), sizeof(int32_t), category_ids.size(), fp) == category_ids.size();
+		ok &= MappedFile::write_padding(fp, header.category_ids + category_ids.size() * sizeof(int32_t));
+		ok &= std::fwrite(biases.data(), sizeof(float), biases.size(), fp) == biases.size();
+		ok &= MappedFile::write_padding(fp, header.biases + biases.size() * sizeof(float));
+		ok &= std::fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), fp) == offsets.size();
+		ok &= std::fwrite(weight_ids.data(), sizeof(int32_t), weight_ids.size(), fp) == weight_ids.size();
+		ok &= MappedFile::write_padding(fp, header.weight_ids + weight_ids.size() * sizeof(int32_t));
+		if (quantized) {
+			ok &= std::fwrite(qweights.data(), sizeof(int8_t), qweights.size(), fp) == qweights.size();
+		} else {
+			ok &= std::fwrite(weights.data(), sizeof(float), weights.size(), fp) == weights.size();
+		}
+		ok &= MappedFile::write_padding(fp, header.weights + weight_ids.size() * weight_size);
+		ok &= std::fwrite(slots.data(), sizeof(int32_t), slots.size(), fp) == slots.size();
+		if (quantized) {
+			ok &= MappedFile::write_padding(fp, header.slots + slots.size() * sizeof(int32_t));
+			ok &= std::fwrite(scales.data(), sizeof(float), scales.size(), fp) == scales.size();
+		}
+		ok &= std::fclose(fp) == 0;
+		
+		return ok;
+	}
+	
+	bool
+	load(const char *file)
+	{
+		const header_t *header;
+		char magic[8];
+		
+		clear();
+		if (!m_file.open(file)) {
+			return false;
+		}
+		set_magic(magic);
+		if (m_file.size() >= sizeof(header_t)
+			&& std::memcmp(m_file.data(), "LSHTC", 5) == 0
+			&& std::memcmp(m_file.data(), magic, sizeof(magic)) != 0)
+		{
+			// another file of this project, e.g. the centroid file
+			std::fprintf(stderr, "ClassifierStorage: %s: not a model file\n", file);
+			clear();
+			return false;
+		}
+		if (m_file.size() < sizeof(header_t)
+			|| std::memcmp(m_file.data(), magic, sizeof(magic)) != 0)
+		{
+			m_file.close();
+			return load_records(file);
+		}
+		header = (const header_t *)m_file.data();
+		if (header->version != 1 && header->version != VERSION) {
+			std::fprintf(stderr, "ClassifierStorage: %s: unsupported version %u\n",
+						 file, header->version);
+			clear();
+			return false;
+		}
+		// version 1 has no flags and no scales
+		m_quantized = header->version >= 2 && (header->flags & FLAG_QUANTIZED) != 0;
+		// the sections are in file order and must not overlap
+		const header_t &h = *header;
+		if (h.models + 1 == 0
+			|| h.category_ids < sizeof(header_t)
+			|| !MappedFile::section_fits(h.category_ids, h.models, sizeof(int32_t), h.biases)
+			|| !MappedFile::section_fits(h.biases, h.models, sizeof(float), h.offsets)
+			|| !MappedFile::section_fits(h.offsets, h.models + 1, sizeof(uint64_t), h.weight_ids)
+			|| !MappedFile::section_fits(h.weight_ids, h.nnz, sizeof(int32_t), h.weights)
+			|| !MappedFile::section_fits(h.weights, h.nnz, m_quantized ? sizeof(int8_t) : sizeof(float),
+										 h.slots)
+			|| !MappedFile::section_fits(h.slots, h.slot_size, sizeof(int32_t),
+										 m_quantized ? h.scales : m_file.size())
+			|| (m_quantized && !MappedFile::section_fits(h.scales, h.models, sizeof(float), m_file.size())))
+		{
+			std::fprintf(stderr, "ClassifierStorage: %s: invalid format 6\n", file);
+			clear();
+			return false;
+		}
+		m_category_ids.set((const int32_t *)(m_file.data() + h.category_ids), h.models);
+		m_biases.set((const float *)(m_file.data() + h.biases), h.models);
+		m_offsets.set((const uint64_t *)(m_file.data() + h.offsets), h.models + 1);
+		m_weight_ids.set((const int32_t *)(m_file.data() + h.weight_ids), h.nnz);
+		if (m_quantized) {
+			m_qweights.set((const int8_t *)(m_file.data() + h.weights), h.nnz);
+			m_scales.set((const float *)(m_file.data() + h.scales), h.models);
+		} else {
+			m_weights.set((const float *)(m_file.data() + h.weights), h.nnz);
+		}
+		m_slots.set((const int32_t *)(m_file.data() + h.slots), h.slot_size);
+		// the category ids are binary searched, the weight ids of a model
+		// too and they index the term index
+		if (!MappedFile::offsets_valid(m_offsets.data(), h.models, h.nnz)
+			|| !MappedFile::ids_increasing(m_category_ids.data(), h.models)
+			|| !MappedFile::ids_valid(m_weight_ids.data(), h.nnz))
+		{
+			std::fprintf(stderr, "ClassifierStorage: %s: invalid format 7\n", file);
+			clear();
+			return false;
+		}
+		for (size_t i = 0; i < h.models; ++i) {
+			if (!MappedFile::ids_increasing(m_weight_ids.data() + m_offsets[i],
+											m_offsets[i + 1] - m_offsets[i]))
+			{
+				std::fprintf(stderr, "ClassifierStorage: %s: invalid format 7\n", file);
+				clear();
+				return false;
+			}
+		}
+		// a slot is -1 or the model of its category id
+		for (size_t c = 0; c < h.slot_size; ++c) {
+			int32_t i = m_slots[c];
+			if (i < -1 || (i >= 0 && ((uint64_t)i >= h.models || m_category_ids[i] != (int32_t)c))) {
+				std::fprintf(stderr, "ClassifierStorage: %s: invalid format 8\n", file);
+				clear();
+				return false;
+			}
+		}
+		
 		return true;
 	}
 };
@@ -0,0 +1,36 @@
+#include "util.hpp"
+#include "reader.hpp"
+#include "tick.hpp"
+#include "compiled_dataset.hpp"
+#include <cstdio>
+
+// convert train.csv/test.csv to the compiled (CSR) format
+
+int main(int argc, char **argv)
+{
+	DataReader reader;
+	std::vector<fv_t> data;
+	std::vector<label_t> labels;
+	long t = tick();
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <input.csv> <output.bin>\n", argv[0]);
+		return -1;
+	}
+	if (!reader.open(argv[1])) {
+		fprintf(stderr, "open failed: %s\n", argv[1]);
+		return -1;
+	}
+	reader.read(data, labels);
+	reader.close();
+	printf("read %ld, %ld, %ldms\n", data.size(), labels.size(), tick() - t);
+
+	t = tick();
+	if (!CompiledDataset::write(argv[2], data, labels)) {
+		fprintf(stderr, "write failed: %s\n", argv[2]);
+		return -1;
+	}
+	printf("write %s %ldms\n", argv[2], tick() - t);
+
+	return 0;
+}
@@ -0,0 +1,306 @@
+#ifndef COMPILED_DATASET_HPP
+#define COMPILED_DATASET_HPP
+
+#include "util.hpp"
+#include "mapped_file.hpp"
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+// Compiled dataset (CSR layout).
+// Written once by ./compile_dataset, then mapped read-only by DataReader.
+// open() checks that every section is within the file, the offsets are
+// nondecreasing and end at nnz, no id is negative and the term ids are
+// strictly increasing in each row, so the row views stay in bounds and
+// are sorted like the vectors of the text reader.
+// read() still copies the rows into a feature vector per document,
+// which the programs transform in place; only the parsing is saved.
+//
+// header
+// row_offsets   uint64_t[rows + 1]
+// term_ids      int32_t[nnz]
+// values        float[nnz]
+// label_offsets uint64_t[rows + 1]
+// label_ids     int32_t[label_nnz]
+class CompiledDataset
+{
+public:
+	static const uint32_t VERSION = 1;
+
+	typedef struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t rows;
+		uint64_t nnz;
+		uint64_t label_nnz;
+		uint64_t row_offsets;
+		uint64_t term_ids;
+		uint64_t values;
+		uint64_t label_offsets;
+		uint64_t label_ids;
+	} header_t;
+
+private:
+	MappedFile m_file;
+	const header_t *m_header;
+	const uint64_t *m_row_offsets;
+	const int32_t *m_term_ids;
+	const float *m_values;
+	const uint64_t *m_label_offsets;
+	const int32_t *m_label_ids;
+
+	static void
+	set_magic(char *magic)
+	{
+		std::memcpy(magic, "LSHTCCSR", 8);
+	}
+
+public:
+	CompiledDataset()
+		: m_header(0), m_row_offsets(0), m_term_ids(0), m_values(0),
+		  m_label_offsets(0), m_label_ids(0)
+	{}
+
+	static bool
+	is_compiled(const char *data, size_t size)
+	{
+		char magic[8];
+		set_magic(magic);
+		return size >= sizeof(header_t) && std::memcmp(data, magic, 8) == 0;
+	}
+
+	bool
+	open(const char *file)
+	{
+		close();
+		if (!m_file.open(file) || !is_compiled(m_file.data(), m_file.size())) {
+			std::fprintf(stderr, "CompiledDataset: %s: invalid format 1\n", file);
+			close();
+			return false;
+		}
+		m_header = (const header_t *)m_file.data();
+		if (m_header->version != VERSION) {
+			std::fprintf(stderr, "CompiledDataset: %s: unsupported version %u\n",
+						 file, m_header->version);
+			close();
+			return false;
+		}
+		// the sections are in file order and must not overlap
+		const header_t &h = *m_header;
+		if (h.rows + 1 == 0
+			|| !MappedFile::section_fits(h.row_offsets, h.rows + 1, sizeof(uint64_t), h.term_ids)
+			|| h.row_offsets < sizeof(header_t)
+			|| !MappedFile::section_fits(h.term_ids, h.nnz, sizeof(int32_t), h.values)
+			|| !MappedFile::section_fits(h.values, h.nnz, sizeof(float), h.label_offsets)
+			|| !MappedFile::section_fits(h.label_offsets, h.rows + 1, sizeof(uint64_t), h.label_ids)
+			|| !MappedFile::section_fits(h.label_ids, h.label_nnz, sizeof(int32_t), m_file.size()))
+		{
+			std::fprintf(stderr, "CompiledDataset: %s: invalid format 2\n", file);
+			close();
+			return false;
+		}
+		m_row_offsets = (const uint64_t *)(m_file.data() + h.row_offsets);
+		m_term_ids = (const int32_t *)(m_file.data() + h.term_ids);
+		m_values = (const float *)(m_file.data() + h.values);
+		m_label_offsets = (const uint64_t *)(m_file.data() + h.label_offsets);
+		m_label_ids = (const int32_t *)(m_file.data() + h.label_ids);
+		if (!MappedFile::offsets_valid(m_row_offsets, h.rows, h.nnz)
+			|| !MappedFile::offsets_valid(m_label_offsets, h.rows, h.label_nnz))
+		{
+			std::fprintf(stderr, "CompiledDataset: %s: invalid format 3\n", file);
+			close();
+			return false;
+		}
+		if (!MappedFile::ids_valid(m_term_ids, h.nnz) || !MappedFile::ids_valid(m_label_ids, h.label_nnz)) {
+			std::fprintf(stderr, "CompiledDataset: %s: invalid format 4\n", file);
+			close();
+			return false;
+		}
+		// the text reader sorts the rows (fv_sort), the kernels and the
+		// merge joins rely on it
+		for (uint64_t i = 0; i < h.rows; ++i) {
+			if (!MappedFile::ids_increasing(row_ids(i), row_size(i))) {
+				std::fprintf(stderr, "CompiledDataset: %s: invalid format 5\n", file);
+				close();
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	void
+	close(void)
+	{
+		m_file.close();
+		m_header = 0;
+		m_row_offsets = m_label_offsets = 0;
+		m_term_ids = m_label_ids = 0;
+		m_values = 0;
+	}
+
+	inline size_t
+	size(void) const
+	{
+		return m_header ? (size_t)m_header->rows : 0;
+	}
+	inline size_t
+	nnz(void) const
+	{
+		return m_header ? (size_t)m_header->nnz : 0;
+	}
+
+	// row view
+	inline size_t
+	row_size(size_t i) const
+	{
+		return (size_t)(m_row_offsets[i + 1] - m_row_offsets[i]);
+	}
+	inline const int32_t *
+	row_ids(size_t i) const
+	{
+		return m_term_ids + m_row_offsets[i];
+	}
+	inline const float *
+	row_values(size_t i) const
+	{
+		return m_values + m_row_offsets[i];
+	}
+	inline size_t
+	label_size(size_t i) const
+	{
+		return (size_t)(m_label_offsets[i + 1] - m_label_offsets[i]);
+	}
+	inline const int32_t *
+	label_ids(size_t i) const
+	{
+		return m_label_ids + m_label_offsets[i];
+	}
+
+	void
+	read(std::vector<fv_t> &data,
+		 std::vector<label_t> &labels) const
+	{
+		read(data, labels, 0, size());
+	}
+	// the features only
+	void
+	read(std::vector<fv_t> &data) const
+	{
+		data.clear();
+		data.resize(size());
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1024)
+#endif
+		for (long i = 0; i < (long)size(); ++i) {
+			const int32_t *ids = row_ids(i);
+			const float *values = row_values(i);
+			data[i].resize(row_size(i));
+			for (size_t j = 0; j < row_size(i); ++j) {
+				data[i][j] = std::make_pair((int)ids[j], values[j]);
+			}
+		}
+	}
+	// the same index as build_category_index(index, data, labels),
+	// from the mapped label ids (no label set per document)
+	void
+	build_category_index(category_index_t &index) const
+	{
+		index.clear();
+		for (size_t i = 0; i < size(); ++i) {
+			const int32_t *label = label_ids(i);
+			for (size_t j = 0; j < label_size(i); ++j) {
+				index[label[j]].push_back((int)i);
+			}
+		}
+	}
+	// rows begin .. end - 1
+	void
+	read(std::vector<fv_t> &data,
+		 std::vector<label_t> &labels,
+		 size_t begin, size_t end) const
+	{
+		end = std::min(end, size());
+		begin = std::min(begin, end);
+		data.clear();
+		labels.clear();
+		data.resize(end - begin);
+		labels.resize(end - begin);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1024)
+#endif
+		for (long i = 0; i < (long)(end - begin); ++i) {
+			const int32_t *ids = row_ids(begin + i);
+			const float *values = row_values(begin + i);
+			const int32_t *label = label_ids(begin + i);
+			data[i].resize(row_size(begin + i));
+			for (size_t j = 0; j < row_size(begin + i); ++j) {
+				data[i][j] = std::make_pair((int)ids[j], values[j]);
+			}
+			labels[i].insert(label, label + label_size(begin + i));
+		}
+	}
+
+	static bool
+	write(const char *file,
+		  const std::vector<fv_t> &data,
+		  const std::vector<label_t> &labels)
+	{
+		header_t header;
+		std::vector<uint64_t> row_offsets;
+		std::vector<uint64_t> label_offsets;
+		std::vector<int32_t> term_ids;
+		std::vector<float> values;
+		std::vector<int32_t> label_ids;
+		bool ok = true;
+
+		row_offsets.reserve(data.size() + 1);
+		label_offsets.reserve(data.size() + 1);
+		row_offsets.push_back(0);
+		label_offsets.push_back(0);
+		for (size_t i = 0; i < data.size(); ++i) {
+			for (auto word = data[i].begin(); word != data[i].end(); ++word) {
+				term_ids.push_back(word->first);
+				values.push_back(word->second);
+			}
+			row_offsets.push_back(term_ids.size());
+			if (i < labels.size()) {
+				std::copy(labels[i].begin(), labels[i].end(),
+						  std::back_inserter(label_ids));
+			}
+			label_offsets.push_back(label_ids.size());
+		}
+
+		std::memset(&header, 0, sizeof(header));
+		set_magic(header.magic);
+		header.version = VERSION;
+		header.rows = data.size();
+		header.nnz = term_ids.size();
+		header.label_nnz = label_ids.size();
+		header.row_offsets = MappedFile::align8(sizeof(header));
+		header.term_ids = MappedFile::align8(header.row_offsets + row_offsets.size() * sizeof(uint64_t));
+		header.values = MappedFile::align8(header.term_ids + term_ids.size() * sizeof(int32_t));
+		header.label_offsets = MappedFile::align8(header.values + values.size() * sizeof(float));
+		header.label_ids = MappedFile::align8(header.label_offsets + label_offsets.size() * sizeof(uint64_t));
+
+		FILE *fp = std::fopen(file, "wb");
+		if (fp == 0) {
+			return false;
+		}
+		ok &= std::fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok &= MappedFile::write_padding(fp, sizeof(header));
+		ok &= std::fwrite(row_offsets.data(), sizeof(uint64_t), row_offsets.size(), fp) == row_offsets.size();
+		ok &= std::fwrite(term_ids.data(), sizeof(int32_t), term_ids.size(), fp) == term_ids.size();
+		ok &= MappedFile::write_padding(fp, header.term_ids + term_ids.size() * sizeof(int32_t));
+		ok &= std::fwrite(values.data(), sizeof(float), values.size(), fp) == values.size();
+		ok &= MappedFile::write_padding(fp, header.values + values.size() * sizeof(float));
+		ok &= std::fwrite(label_offsets.data(), sizeof(uint64_t), label_offsets.size(), fp) == label_offsets.size();
+		ok &= std::fwrite(label_ids.data(), sizeof(int32_t), label_ids.size(), fp) == label_ids.size();
+		ok &= std::fclose(fp) == 0;
+
+		return ok;
+	}
+};
+
+#endif
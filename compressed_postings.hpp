@@ -0,0 +1,506 @@
+#ifndef COMPRESSED_POSTINGS_HPP
+#define COMPRESSED_POSTINGS_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cstdio>
+#include <stdint.h>
+#include "mapped_file.hpp"
+#include "util.hpp"
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+// Compressed posting lists for InvertedIndex.
+//
+// doc ids: every full block of 128 postings is bit-packed with the
+// smallest bit width of the block. Values are laid out as 4 interleaved
+// lanes of 32 values, and each id is stored as the difference to the id
+// 4 positions earlier, so that a block is decoded with 4-wide shifts,
+// masks and adds. The remaining (< 128) postings are variable-byte coded.
+// values: 8-bit quantized, min_value + q * scale for each list.
+//
+// list layout
+//   full blocks   { uint8_t bits; uint32_t words[bits * 4]; } ...
+//   tail          variable-byte id differences
+//   values        uint8_t[size]
+//
+// file section written by write() and mapped by attach()
+//   header
+//   offsets       uint64_t[lists + 1]
+//   sizes         uint32_t[lists]
+//   min_values    float[lists]
+//   scales        float[lists]
+//   bytes         uint8_t[offsets[lists]]
+class CompressedPostings
+{
+public:
+	static const int BLOCK_SIZE = 128;
+	static const int LANES = 4;
+	static const uint32_t FILE_VERSION = 1;
+	
+	typedef struct file_header {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t lists;
+		uint64_t offsets;
+		uint64_t sizes;
+		uint64_t min_values;
+		uint64_t scales;
+		uint64_t bytes;
+		uint64_t size;
+	} file_header_t;
+	
+	class Decoder
+	{
+		friend class CompressedPostings;
+		
+		const uint8_t *m_p;
+		const uint8_t *m_values;
+		size_t m_blocks;
+		size_t m_rest;
+		float m_min_value;
+		float m_scale;
+		uint32_t m_base[LANES];
+	
+	public:
+		Decoder() : m_p(0), m_values(0), m_blocks(0), m_rest(0),
+					m_min_value(0.0f), m_scale(0.0f)
+		{
+			std::memset(m_base, 0, sizeof(m_base));
+		}
+		
+		// decodes the next (up to BLOCK_SIZE) postings.
+		// returns the number of postings, 0 at the end of the list.
+		inline size_t
+		next(int *ids, float *values)
+		{
+			size_t n;
+			
+			if (m_rest == 0) {
+				return 0;
+			}
+			if (m_blocks > 0) {
+				int bits = *m_p++;
+				n = BLOCK_SIZE;
+				unpack(ids, m_p, bits, m_base);
+				m_p += bits * LANES * sizeof(uint32_t);
+				--m_blocks;
+			} else {
+				uint32_t id = m_base[LANES - 1];
+				n = m_rest;
+				for (size_t i = 0; i < n; ++i) {
+					uint32_t delta = 0;
+					int shift = 0;
+					while (*m_p & 0x80) {
+						delta |= (uint32_t)(*m_p++ & 0x7f) << shift;
+						shift += 7;
+					}
+					delta |= (uint32_t)(*m_p++) << shift;
+					id += delta;
+					ids[i] = (int)id;
+				}
+			}
+			for (size_t i = 0; i < n; ++i) {
+				values[i] = m_min_value + m_values[i] * m_scale;
+			}
+			m_values += n;
+			m_rest -= n;
+			
+			return n;
+		}
+	};
+
+private:
+	// the arrays point into the buffers below, or into a mapped file
+	// after attach()
+	MappedArray<uint8_t> m_bytes;
+	MappedArray<uint64_t> m_offsets;
+	MappedArray<uint32_t> m_sizes;
+	MappedArray<float> m_min_values;
+	MappedArray<float> m_scales;
+	std::vector<uint8_t> m_byte_buffer;
+	std::vector<uint64_t> m_offset_buffer;
+	std::vector<uint32_t> m_size_buffer;
+	std::vector<float> m_min_value_buffer;
+	std::vector<float> m_scale_buffer;
+	
+	void
+	use_buffers(void)
+	{
+		m_bytes.set(m_byte_buffer);
+		m_offsets.set(m_offset_buffer);
+		m_sizes.set(m_size_buffer);
+		m_min_values.set(m_min_value_buffer);
+		m_scales.set(m_scale_buffer);
+	}
+	
+	static inline int
+	bit_width(uint32_t v)
+	{
+		int bits = 0;
+		while (v != 0) {
+			++bits;
+			v >>= 1;
+		}
+		return bits;
+	}
+	
+	static inline void
+	put_u32(std::vector<uint8_t> &out, uint32_t v)
+	{
+		uint8_t bytes[sizeof(uint32_t)];
+		std::memcpy(bytes, &v, sizeof(v));
+		out.insert(out.end(), bytes, bytes + sizeof(v));
+	}
+	
+	// out[j * LANES + l] (the j-th value of lane l) is stored
+	// in bits 32-bit words of lane l, interleaved as words[w * LANES + l]
+	static void
+	pack(std::vector<uint8_t> &out, const uint32_t *in, int bits)
+	{
+		uint32_t words[32 * LANES];
+		
+		std::memset(words, 0, sizeof(words));
+		for (int j = 0; j < BLOCK_SIZE / LANES; ++j) {
+			int w = (j * bits) / 32;
+			int shift = (j * bits) % 32;
+			for (int l = 0; l < LANES; ++l) {
+				uint32_t v = in[j * LANES + l];
+				words[w * LANES + l] |= v << shift;
+				if (shift + bits > 32) {
+					words[(w + 1) * LANES + l] |= v >> (32 - shift);
+				}
+			}
+		}
+		out.push_back((uint8_t)bits);
+		for (int i = 0; i < bits * LANES; ++i) {
+			put_u32(out, words[i]);
+		}
+	}
+	
+	// inverse of pack(), then adds the differences to base
+	static inline void
+	unpack(int *ids, const uint8_t *in, int bits, uint32_t *base)
+	{
+		const int rows = BLOCK_SIZE / LANES;
+		int shift = 0;
+		int w = 0;
+#ifdef __SSE2__
+		const __m128i mask = _mm_set1_epi32(bits == 32 ? -1 : (int)((1u << bits) - 1));
+		__m128i acc = _mm_loadu_si128((const __m128i *)base);
+		__m128i word = bits > 0 ? _mm_loadu_si128((const __m128i *)in) : _mm_setzero_si128();
+		
+		for (int j = 0; j < rows; ++j) {
+			__m128i v = _mm_srl_epi32(word, _mm_cvtsi32_si128(shift));
+			shift += bits;
+			if (shift >= 32) {
+				shift -= 32;
+				if (++w < bits) {
+					word = _mm_loadu_si128((const __m128i *)in + w);
+					if (shift > 0) {
+						v = _mm_or_si128(v, _mm_sll_epi32(word, _mm_cvtsi32_si128(bits - shift)));
+					}
+				}
+			}
+			acc = _mm_add_epi32(acc, _mm_and_si128(v, mask));
+			_mm_storeu_si128((__m128i *)(ids + j * LANES), acc);
+		}
+		_mm_storeu_si128((__m128i *)base, acc);
+#else
+		const uint32_t mask = bits == 32 ? 0xffffffffu : (1u << bits) - 1;
+		uint32_t word[LANES] = {0};
+		uint32_t next[LANES];
+		
+		if (bits > 0) {
+			std::memcpy(word, in, sizeof(word));
+		}
+		for (int j = 0; j < rows; ++j) {
+			uint32_t v[LANES];
+			for (int l = 0; l < LANES; ++l) {
+				v[l] = word[l] >> shift;
+			}
+			shift += bits;
+			if (shift >= 32) {
+				shift -= 32;
+				if (++w < bits) {
+					std::memcpy(next, in + w * sizeof(word), sizeof(next));
+					for (int l = 0; l < LANES; ++l) {
+						if (shift > 0) {
+							v[l] |= next[l] << (bits - shift);
+						}
+						word[l] = next[l];
+					}
+				}
+			}
+			for (int l = 0; l < LANES; ++l) {
+				base[l] += v[l] & mask;
+				ids[j * LANES + l] = (int)base[l];
+			}
+		}
+#endif
+	}
+
+public:
+	CompressedPostings()
+	{
+		clear();
+	}
+	
+	void
+	clear(void)
+	{
+		m_byte_buffer.clear();
+		m_offset_buffer.assign(1, 0);
+		m_size_buffer.clear();
+		m_min_value_buffer.clear();
+		m_scale_buffer.clear();
+		use_buffers();
+	}
+	
+	// number of lists
+	inline size_t
+	size(void) const
+	{
+		return m_sizes.size();
+	}
+	inline size_t
+	list_size(size_t i) const
+	{
+		return m_sizes[i];
+	}
+	// bytes used by the encoded lists
+	inline size_t
+	memory_size(void) const
+	{
+		return m_bytes.size()
+			+ m_offsets.size() * sizeof(uint64_t)
+			+ m_sizes.size() * (sizeof(uint32_t) + 2 * sizeof(float));
+	}
+	// heap bytes of the buffers (0 when attached to a file)
+	size_t
+	memory_usage(void) const
+	{
+		return ::memory_usage(m_byte_buffer)
+			+ ::memory_usage(m_offset_buffer)
+			+ ::memory_usage(m_size_buffer)
+			+ ::memory_usage(m_min_value_buffer)
+			+ ::memory_usage(m_scale_buffer);
+	}
+	
+	// encodes a list of n postings sorted by id into out.
+	// returns the quantization parameters of the values.
+	static void
+	encode(std::vector<uint8_t> &out,
+		   float &min_value, float &scale,
+		   const int *ids, const float *values, size_t n)
+	{
+		size_t blocks = n / BLOCK_SIZE;
+		uint32_t base[LANES] = {0};
+		uint32_t prev;
+		float max_value;
+		
+		out.clear();
+		for (size_t b = 0; b < blocks; ++b) {
+			const int *block = ids + b * BLOCK_SIZE;
+			uint32_t deltas[BLOCK_SIZE];
+			uint32_t bits_or = 0;
+			for (int j = 0; j < BLOCK_SIZE; ++j) {
+				deltas[j] = (uint32_t)block[j] - base[j % LANES];
+				base[j % LANES] = (uint32_t)block[j];
+				bits_or |= deltas[j];
+			}
+			pack(out, deltas, bit_width(bits_or));
+		}
+		prev = base[LANES - 1];
+		for (size_t i = blocks * BLOCK_SIZE; i < n; ++i) {
+			uint32_t delta = (uint32_t)ids[i] - prev;
+			prev = (uint32_t)ids[i];
+			while (delta >= 0x80) {
+				out.push_back((uint8_t)(delta | 0x80));
+				delta >>= 7;
+			}
+			out.push_back((uint8_t)delta);
+		}
+		
+		min_value = max_value = n > 0 ? values[0] : 0.0f;
+		for (size_t i = 0; i < n; ++i) {
+			min_value = std::min(min_value, values[i]);
+			max_value = std::max(max_value, values[i]);
+		}
+		scale = (max_value - min_value) / 255.0f;
+		for (size_t i = 0; i < n; ++i) {
+			int q = scale > 0.0f ? (int)std::floor((values[i] - min_value) / scale + 0.5f) : 0;
+			out.push_back((uint8_t)std::max(0, std::min(255, q)));
+		}
+	}
+	
+	// appends a list encoded by encode()
+	void
+	append(const std::vector<uint8_t> &list, size_t n,
+		   float min_value, float scale)
+	{
+		m_byte_buffer.insert(m_byte_buffer.end(), list.begin(), list.end());
+		m_offset_buffer.push_back(m_byte_buffer.size());
+		m_size_buffer.push_back((uint32_t)n);
+		m_min_value_buffer.push_back(min_value);
+		m_scale_buffer.push_back(scale);
+		use_buffers();
+	}
+	
+	// releases unused capacity after the last append()
+	void
+	shrink(void)
+	{
+		std::vector<uint8_t>(m_byte_buffer).swap(m_byte_buffer);
+		std::vector<uint64_t>(m_offset_buffer).swap(m_offset_buffer);
+		std::vector<uint32_t>(m_size_buffer).swap(m_size_buffer);
+		std::vector<float>(m_min_value_buffer).swap(m_min_value_buffer);
+		std::vector<float>(m_scale_buffer).swap(m_scale_buffer);
+		use_buffers();
+	}
+	
+	// writes the lists as a file section at the current position of fp,
+	// which must be 8-byte aligned
+	bool
+	write(FILE *fp) const
+	{
+		file_header_t header;
+		bool ok = true;
+		
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "LSHTCCPL", 8);
+		header.version = FILE_VERSION;
+		header.lists = size();
+		header.offsets = MappedFile::align8(sizeof(header));
+		header.sizes = MappedFile::align8(header.offsets + m_offsets.size() * sizeof(uint64_t));
+		header.min_values = MappedFile::align8(header.sizes + m_sizes.size() * sizeof(uint32_t));
+		header.scales = MappedFile::align8(header.min_values + m_min_values.size() * sizeof(float));
+		header.bytes = MappedFile::align8(header.scales + m_scales.size() * sizeof(float));
+		header.size = MappedFile::align8(header.bytes + m_bytes.size());
+		
+		ok &= std::fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok &= MappedFile::write_padding(fp, sizeof(header));
+		ok &= std::fwrite(m_offsets.data(), sizeof(uint64_t), m_offsets.size(), fp) == m_offsets.size();
+		ok &= std::fwrite(m_sizes.data(), sizeof(uint32_t), m_sizes.size(), fp) == m_sizes.size();
+		ok &= MappedFile::write_padding(fp, header.sizes + m_sizes.size() * sizeof(uint32_t));
+		ok &= std::fwrite(m_min_values.data(), sizeof(float), m_min_values.size(), fp) == m_min_values.size();
+		ok &= MappedFile::write_padding(fp, header.min_values + m_min_values.size() * sizeof(float));
+		ok &= std::fwrite(m_scales.data(), sizeof(float), m_scales.size(), fp) == m_scales.size();
+		ok &= MappedFile::write_padding(fp, header.scales + m_scales.size() * sizeof(float));
+		ok &= std::fwrite(m_bytes.data(), 1, m_bytes.size(), fp) == m_bytes.size();
+		ok &= MappedFile::write_padding(fp, header.bytes + m_bytes.size());
+		
+		return ok;
+	}
+	
+	// uses a section written by write() in place. data must be 8-byte
+	// aligned and stay mapped while the lists are used.
+	// returns the size of the section, or 0 when it is invalid.
+	size_t
+	attach(const char *data, size_t size)
+	{
+		const file_header_t *header = (const file_header_t *)data;
+		
+		clear();
+		if (size < sizeof(file_header_t)
+			|| std::memcmp(header->magic, "LSHTCCPL", 8) != 0
+			|| header->version != FILE_VERSION
+			|| header->size > size
+			|| header->lists + 1 == 0
+			|| header->offsets < sizeof(file_header_t)
+			|| !MappedFile::section_fits(header->offsets, header->lists + 1, sizeof(uint64_t), header->sizes)
+			|| !MappedFile::section_fits(header->sizes, header->lists, sizeof(uint32_t), header->min_values)
+			|| !MappedFile::section_fits(header->min_values, header->lists, sizeof(float), header->scales)
+			|| !MappedFile::section_fits(header->scales, header->lists, sizeof(float), header->bytes)
+			|| !MappedFile::section_fits(header->bytes, ((const uint64_t *)(data + header->offsets))[header->lists],
+										 1, header->size))
+		{
+			return 0;
+		}
+		m_offsets.set((const uint64_t *)(data + header->offsets), header->lists + 1);
+		m_sizes.set((const uint32_t *)(data + header->sizes), header->lists);
+		m_min_values.set((const float *)(data + header->min_values), header->lists);
+		m_scales.set((const float *)(data + header->scales), header->lists);
+		m_bytes.set((const uint8_t *)(data + header->bytes), m_offsets[header->lists]);
+		if (!MappedFile::offsets_valid(m_offsets.data(), header->lists, m_offsets[header->lists])) {
+			clear();
+			return 0;
+		}
+		
+		return header->size;
+	}
+	
+	// checks that list i decodes within its bytes to strictly increasing
+	// ids below docs, for lists of a mapped file (decoder() trusts them)
+	bool
+	valid(size_t i, size_t docs) const
+	{
+		const uint8_t *p = m_bytes.data() + m_offsets[i];
+		const uint8_t *end = m_bytes.data() + m_offsets[i + 1];
+		size_t n = m_sizes[i];
+		uint32_t base[LANES] = {0};
+		int ids[BLOCK_SIZE];
+		int last = -1;
+		
+		// the values are the last n bytes
+		if (n > (size_t)(end - p)) {
+			return false;
+		}
+		end -= n;
+		for (size_t b = 0; b < n / BLOCK_SIZE; ++b) {
+			if (p == end || *p > 32
+				|| (size_t)(end - p - 1) < *p * LANES * sizeof(uint32_t))
+			{
+				return false;
+			}
+			int bits = *p++;
+			unpack(ids, p, bits, base);
+			p += bits * LANES * sizeof(uint32_t);
+			for (int j = 0; j < BLOCK_SIZE; ++j) {
+				if (ids[j] <= last || (size_t)ids[j] >= docs) {
+					return false;
+				}
+				last = ids[j];
+			}
+		}
+		uint32_t id = base[LANES - 1];
+		for (size_t j = n / BLOCK_SIZE * BLOCK_SIZE; j < n; ++j) {
+			uint32_t delta = 0;
+			int shift = 0;
+			do {
+				if (p == end || shift > 28) {
+					return false;
+				}
+				delta |= (uint32_t)(*p & 0x7f) << shift;
+				shift += 7;
+			} while (*p++ & 0x80);
+			id += delta;
+			if ((int)id <= last || (size_t)(int)id >= docs) {
+				return false;
+			}
+			last = (int)id;
+		}
+		return true;
+	}
+	
+	inline Decoder
+	decoder(size_t i) const
+	{
+		Decoder decoder;
+		
+		decoder.m_p = m_bytes.data() + m_offsets[i];
+		decoder.m_values = m_bytes.data() + m_offsets[i + 1] - m_sizes[i];
+		decoder.m_blocks = m_sizes[i] / BLOCK_SIZE;
+		decoder.m_rest = m_sizes[i];
+		decoder.m_min_value = m_min_values[i];
+		decoder.m_scale = m_scales[i];
+		
+		return decoder;
+	}
+};
+
+#endif
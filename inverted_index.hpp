@@ -2,6 +2,14 @@
 #define INVERTED_INDEX_HPP
 
 #include "util.hpp"
+#include "compressed_postings.hpp"
+#include "sparse_kernels.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
 
 // Inverted Index for k-NN
 class InvertedIndex
@@ -16,19 +24,76 @@ public:
 			this->id = id;
 			this->cosine = cosine;
 		}
+		// higher cosine first, lower id first on ties
 		inline bool
 		operator>(const struct result &rhs) const
 		{
-			return cosine > rhs.cosine;
+			return cosine > rhs.cosine || (cosine == rhs.cosine && id < rhs.id);
 		}
 	} result_element_t;
 	typedef std::vector<result_element_t> result_t;
 	
+	// queries per block in knn_batch() (at most 32)
+	static const int BATCH_SIZE = 32;
+	static const uint32_t FILE_VERSION = 2;
+	
+	// file section written by write() and mapped by attach().
+	// offsets are relative to the section and 8-byte aligned.
+	//
+	// header
+	// offsets        uint64_t[words + 1]
+	// postings       { int32_t doc_id; float value; }[postings]
+	// block_offsets  uint64_t[words + 1]
+	// blocks         { int32_t last_doc_id; float max_value; }[blocks]
+	// max_values     float[words]
+	// compressed     CompressedPostings::write() section
+	//
+	// a compressed index has no postings and blocks, and one block offset.
+	// version 1 sections (no compressed field) are still read.
+	typedef struct file_header {
+		char magic[8];
+		uint32_t version;
+		uint32_t nonnegative;
+		uint64_t docs;
+		uint64_t words;
+		uint64_t postings;
+		uint64_t blocks;
+		uint64_t offsets;
+		uint64_t posting_data;
+		uint64_t block_offsets;
+		uint64_t block_data;
+		uint64_t max_values;
+		uint64_t size;
+		uint64_t compressed;
+	} file_header_t;
+
 private:
+	// postings per block for block-max pruning
+	static const int BLOCK_SIZE = 64;
+	// raw postings held at once while building a compressed index
+	static const size_t BUILD_CHUNK = 1 << 24;
+	// docs per accumulator tile in knn_batch()
+	static const int TILE_SIZE = 1024;
+	// upper bounds are padded so that rounding never prunes a hit
+	static inline float
+	bound_slack(void)
+	{
+		return 1.0001f;
+	}
+	// relative difference allowed between float sums of the same
+	// nonnegative terms in different orders (maxscore_knn() sums in upper
+	// bound order, knn() in query order)
+	static inline float
+	order_slack(void)
+	{
+		return 1.0002f;
+	}
+	
 	typedef struct inverted_index_word {
 		int doc_id;
 		float value;
 		
+		inverted_index_word() {}
 		inverted_index_word(unsigned int doc_id, float value)
 		{
 			this->doc_id = doc_id;
@@ -40,213 +105,1011 @@ private:
 			return doc_id < rhs.doc_id;
 		}
 	} inverted_index_word_t;
-	typedef std::vector<inverted_index_word_t> inverted_index_doc_t;
-	typedef std::vector<inverted_index_doc_t> inverted_index_t;
 	
-	inverted_index_t m_inverted_index;
-	const std::vector<fv_t> *m_data;
+	typedef struct inverted_index_block {
+		int last_doc_id;
+		float max_value;
+	} inverted_index_block_t;
 	
-	typedef struct word_result {
-		int id;
-		float dot;
+	typedef struct posting_cursor {
+		const inverted_index_word_t *begin;
+		const inverted_index_word_t *cur;
+		const inverted_index_word_t *end;
+		const inverted_index_block_t *blocks;
+		float weight;
+		float upper_bound;
 		
-		word_result(int id, float dot)
+		inline size_t
+		size(void) const
 		{
-			this->id = id;
-			this->dot = dot;
+			return end - begin;
 		}
 		inline bool
-		operator<(const struct word_result &rhs) const
+		operator>(const struct posting_cursor &rhs) const
 		{
-			return id < rhs.id;
+			return upper_bound > rhs.upper_bound;
 		}
-	} word_result_t;
+	} posting_cursor_t;
 	
-	// min heap
-	typedef std::priority_queue<result_element_t,
-								std::vector<result_element_t>,
-								std::greater<std::vector<result_element_t>::value_type> > topn_t;
+	// a query word in knn_batch()
+	typedef struct batch_term {
+		int word_id;
+		int query;
+		float weight;
+		
+		inline bool
+		operator<(const struct batch_term &rhs) const
+		{
+			return word_id < rhs.word_id
+				|| (word_id == rhs.word_id && query < rhs.query);
+		}
+	} batch_term_t;
 	
+	// the queries of a block that share a word
+	typedef struct batch_group {
+		const inverted_index_word_t *cur;
+		const inverted_index_word_t *end;
+		size_t term_begin;
+		size_t term_end;
+		uint32_t queries;
+	} batch_group_t;
+
+public:
+	// Work area for knn()/fast_knn()/maxscore_knn().
+	// Each thread should hold its own context and reuse it for every query,
+	// so that queries do not allocate memory once the buffers have grown.
+	class SearchContext
+	{
+		friend class InvertedIndex;
+		
+		std::vector<float> m_scores;
+		std::vector<char> m_hit;
+		std::vector<int> m_hits;
+		std::vector<result_element_t> m_topn;
+		std::vector<posting_cursor_t> m_cursors;
+		std::vector<int> m_candidates;
+		std::vector<float> m_rest;
+		std::vector<size_t> m_rest_postings;
+		std::vector<float> m_work;
+		fv_t m_query;
+		// fast_knn(), the query as a dense vector (zero between queries)
+		std::vector<float> m_dense_query;
+		// knn_batch()
+		std::vector<batch_term_t> m_terms;
+		std::vector<batch_group_t> m_groups;
+		std::vector<float> m_group_weights;
+		std::vector<float> m_tile_scores;
+		std::vector<uint32_t> m_tile_queries;
+		std::vector<std::vector<result_element_t> > m_batch_topn;
+		
+		void
+		reserve(size_t docs)
+		{
+			if (m_scores.size() < docs) {
+				m_scores.resize(docs, 0.0f);
+				m_hit.resize(docs, 0);
+			}
+		}
+		void
+		reserve_batch(void)
+		{
+			if (m_tile_scores.empty()) {
+				m_tile_scores.resize(TILE_SIZE * BATCH_SIZE, 0.0f);
+				m_tile_queries.resize(TILE_SIZE, 0);
+				m_batch_topn.resize(BATCH_SIZE);
+			}
+		}
+	public:
+		SearchContext() {}
+	};
+
+private:
+	// postings of word w are m_postings[m_offsets[w] .. m_offsets[w + 1]),
+	// sorted by doc_id. its blocks start at m_block_offsets[w].
+	// the arrays point into the buffers below after build(), or into
+	// a mapped file after attach().
+	MappedArray<uint64_t> m_offsets;
+	MappedArray<inverted_index_word_t> m_postings;
+	MappedArray<uint64_t> m_block_offsets;
+	MappedArray<inverted_index_block_t> m_blocks;
+	MappedArray<float> m_max_values;
+	std::vector<uint64_t> m_offset_buffer;
+	std::vector<inverted_index_word_t> m_posting_buffer;
+	std::vector<uint64_t> m_block_offset_buffer;
+	std::vector<inverted_index_block_t> m_block_buffer;
+	std::vector<float> m_max_value_buffer;
+	size_t m_docs;
+	bool m_nonnegative;
+	// compressed postings (m_postings and m_blocks are empty)
+	bool m_compressed;
+	CompressedPostings m_compressed_postings;
+	const std::vector<fv_t> *m_data;
+	
+	void
+	use_buffers(void)
+	{
+		m_offsets.set(m_offset_buffer);
+		m_postings.set(m_posting_buffer);
+		m_block_offsets.set(m_block_offset_buffer);
+		m_blocks.set(m_block_buffer);
+		m_max_values.set(m_max_value_buffer);
+	}
+	
+	inline size_t
+	words(void) const
+	{
+		return m_max_values.size();
+	}
+	inline size_t
+	posting_size(int word_id) const
+	{
+		return m_offsets[word_id + 1] - m_offsets[word_id];
+	}
+	
+	// min heap of the best k results
 	static inline void
-	topn_push(topn_t &topn, size_t k, int id, float cosine)
+	topn_push(std::vector<result_element_t> &topn, size_t k, int id, float cosine)
 	{
+		result_element_t elm(id, cosine);
 		if (k > topn.size()) {
-			topn.push(result_element_t(id, cosine));
-		} else if (topn.top().cosine < cosine) {
-			topn.push(result_element_t(id, cosine));
-			topn.pop();
+			topn.push_back(elm);
+			std::push_heap(topn.begin(), topn.end(), std::greater<result_element_t>());
+		} else if (k > 0 && elm > topn.front()) {
+			std::pop_heap(topn.begin(), topn.end(), std::greater<result_element_t>());
+			topn.back() = elm;
+			std::push_heap(topn.begin(), topn.end(), std::greater<result_element_t>());
 		}
 	}
 	
 	static inline void
-	topn_convert(result_t &results, size_t k, topn_t &topn)
+	topn_convert(result_t &results, std::vector<result_element_t> &topn)
+	{
+		std::sort_heap(topn.begin(), topn.end(), std::greater<result_element_t>());
+		results.assign(topn.begin(), topn.end());
+		topn.clear();
+	}
+	
+	void
+	truncate_query(fv_t &ret, const fv_t &fv, size_t threshold) const
+	{
+		ret.clear();
+		for (auto word = fv.begin(); word != fv.end(); ++word) {
+			if (word->first >= 0 && word->first < (int)words()
+				&& posting_size(word->first) < threshold)
+			{
+				ret.push_back(*word);
+			}
+		}
+	}
+
+	void
+	build_blocks(void)
 	{
-		results.clear();
-		while (topn.size() > 0) {
-			results.push_back(topn.top());
-			topn.pop();
+		std::vector<uint64_t> &block_offsets = m_block_offset_buffer;
+		std::vector<inverted_index_block_t> &blocks = m_block_buffer;
+		std::vector<float> &max_values = m_max_value_buffer;
+		
+		block_offsets.assign(words() + 1, 0);
+		for (size_t w = 0; w < words(); ++w) {
+			size_t n = posting_size(w);
+			block_offsets[w + 1] = block_offsets[w] + (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
 		}
-		std::reverse(results.begin(), results.end());
-		if (results.size() > k) {
-			results.erase(results.begin() + k, results.end());
+		blocks.resize(block_offsets[words()]);
+		m_nonnegative = true;
+		for (size_t w = 0; w < words(); ++w) {
+			const inverted_index_word_t *begin = m_postings.data() + m_offsets[w];
+			const inverted_index_word_t *end = m_postings.data() + m_offsets[w + 1];
+			size_t b = block_offsets[w];
+			
+			max_values[w] = 0.0f;
+			for (const inverted_index_word_t *p = begin; p < end; p += BLOCK_SIZE, ++b) {
+				const inverted_index_word_t *block_end = std::min(p + BLOCK_SIZE, end);
+				float max_value = p->value;
+				for (const inverted_index_word_t *q = p; q < block_end; ++q) {
+					max_value = std::max(max_value, q->value);
+					if (q->value < 0.0f) {
+						m_nonnegative = false;
+					}
+				}
+				blocks[b].last_doc_id = (block_end - 1)->doc_id;
+				blocks[b].max_value = max_value;
+				max_values[w] = std::max(max_values[w], max_value);
+			}
 		}
+		use_buffers();
 	}
 	
-	static inline float
-	fv_cosine(const fv_t &fv1, const fv_t &fv2)
+	// checks the lists of an attached index once, since the search trusts
+	// them: the offsets are nondecreasing and end at the postings, each
+	// word has a block per BLOCK_SIZE postings, the doc ids of a list are
+	// strictly increasing and below m_docs, and each block ends at the
+	// doc id of its last posting
+	bool
+	lists_valid(void) const
 	{
-		float dot = 0.0f;
-		for (auto i = fv1.begin(); i != fv1.end(); ++i) {
-			auto j = fv2.find(i->first);
-			if (j != fv2.end()) {
-				dot += 2.0f * i->second * j->second;
+		if (m_compressed) {
+			if (!MappedFile::offsets_valid(m_offsets.data(), words(), m_offsets[words()])) {
+				return false;
 			}
+			for (size_t w = 0; w < words(); ++w) {
+				if (m_compressed_postings.list_size(w) != posting_size(w)
+					|| !m_compressed_postings.valid(w, m_docs))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+		if (!MappedFile::offsets_valid(m_offsets.data(), words(), m_postings.size())
+			|| !MappedFile::offsets_valid(m_block_offsets.data(), words(), m_blocks.size()))
+		{
+			return false;
 		}
-		return dot;
+		for (size_t w = 0; w < words(); ++w) {
+			const inverted_index_word_t *begin = m_postings.data() + m_offsets[w];
+			const inverted_index_word_t *end = m_postings.data() + m_offsets[w + 1];
+			size_t b = m_block_offsets[w];
+			int last = -1;
+			
+			if (m_block_offsets[w + 1] - b != (posting_size(w) + BLOCK_SIZE - 1) / BLOCK_SIZE) {
+				return false;
+			}
+			for (const inverted_index_word_t *p = begin; p < end; ++p) {
+				if (p->doc_id <= last || (size_t)p->doc_id >= m_docs) {
+					return false;
+				}
+				last = p->doc_id;
+				if ((p + 1 == end || (p - begin) % BLOCK_SIZE == BLOCK_SIZE - 1)
+					&& m_blocks[b++].last_doc_id != p->doc_id)
+				{
+					return false;
+				}
+			}
+		}
+		return true;
 	}
 	
-	fv_t
-	truncate_query(const fv_t &fv, size_t threshold) const
+	// encodes the postings of a range of words at a time, so that at most
+	// BUILD_CHUNK uncompressed postings are held in memory.
+	void
+	build_compressed(void)
 	{
-		fv_t ret;
-		for (auto word = fv.begin(); word != fv.end(); ++word) {
-			if (word->first < (int)m_inverted_index.size()
-				&& m_inverted_index[word->first].size() < threshold)
-			{
-				ret.insert(std::make_pair(word->first, word->second));
+		std::vector<int> ids;
+		std::vector<float> values;
+		std::vector<size_t> pos;
+		std::vector<std::vector<uint8_t> > lists;
+		std::vector<float> min_values;
+		std::vector<float> scales;
+		size_t first = 0;
+		
+		m_compressed_postings.clear();
+		m_nonnegative = true;
+		while (first < words()) {
+			size_t last = first + 1;
+			size_t base = m_offsets[first];
+			
+			while (last < words() && m_offsets[last + 1] - base <= BUILD_CHUNK) {
+				++last;
+			}
+			ids.resize(m_offsets[last] - base);
+			values.resize(m_offsets[last] - base);
+			pos.assign(m_offsets.begin() + first, m_offsets.begin() + last);
+			for (size_t id = 0; id < m_data->size(); ++id) {
+				const fv_t &fv = m_data->at(id);
+				auto word = std::lower_bound(fv.begin(), fv.end(),
+											 std::make_pair((int)first, 0.0f), fv_id_less);
+				for (; word != fv.end() && word->first < (int)last; ++word) {
+					size_t p = pos[word->first - first]++ - base;
+					ids[p] = (int)id;
+					values[p] = word->second;
+				}
+			}
+			lists.resize(last - first);
+			min_values.resize(last - first);
+			scales.resize(last - first);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+			for (long w = (long)first; w < (long)last; ++w) {
+				size_t offset = m_offsets[w] - base;
+				size_t n = posting_size(w);
+				
+				CompressedPostings::encode(lists[w - first],
+										   min_values[w - first], scales[w - first],
+										   ids.data() + offset, values.data() + offset, n);
+				m_max_value_buffer[w] = n > 0 ? *std::max_element(values.begin() + offset,
+																  values.begin() + offset + n) : 0.0f;
 			}
+			for (size_t w = first; w < last; ++w) {
+				m_compressed_postings.append(lists[w - first], posting_size(w),
+											 min_values[w - first], scales[w - first]);
+				std::vector<uint8_t>().swap(lists[w - first]);
+			}
+			for (auto v = values.begin(); v != values.end(); ++v) {
+				if (*v < 0.0f) {
+					m_nonnegative = false;
+				}
+			}
+			first = last;
 		}
+		m_compressed_postings.shrink();
+	}
+	
+	// moves the cursor to the first posting >= doc_id.
+	// returns false when the block containing doc_id cannot lift
+	// score above theta.
+	static inline bool
+	cursor_seek(posting_cursor_t &c, int doc_id, float score, float theta)
+	{
+		size_t b = (c.cur - c.begin) / BLOCK_SIZE;
+		const inverted_index_word_t *block_begin;
+		const inverted_index_word_t *block_end;
 		
-		return ret;
+		if (c.cur == c.end) {
+			return true;
+		}
+		while (c.blocks[b].last_doc_id < doc_id) {
+			++b;
+			if (c.begin + b * BLOCK_SIZE >= c.end) {
+				c.cur = c.end;
+				return true;
+			}
+		}
+		if (score + c.weight * c.blocks[b].max_value * bound_slack() < theta) {
+			return false;
+		}
+		block_begin = std::max(c.cur, c.begin + b * BLOCK_SIZE);
+		block_end = std::min(c.begin + (b + 1) * BLOCK_SIZE, c.end);
+		c.cur = std::lower_bound(block_begin, block_end,
+								 inverted_index_word_t(doc_id, 0.0f));
+		return true;
 	}
-
+	
+	// one block of knn_batch(), n <= BATCH_SIZE
+	void
+	knn_block(SearchContext &context,
+			  result_t *results,
+			  size_t k,
+			  const fv_t *queries,
+			  int n) const
+	{
+		std::vector<batch_term_t> &terms = context.m_terms;
+		std::vector<batch_group_t> &groups = context.m_groups;
+		std::vector<float> &weights = context.m_group_weights;
+		std::vector<float> &scores = context.m_tile_scores;
+		std::vector<uint32_t> &hit = context.m_tile_queries;
+		
+		terms.clear();
+		for (int q = 0; q < n; ++q) {
+			for (auto word = queries[q].begin(); word != queries[q].end(); ++word) {
+				if (word->first >= 0 && word->first < (int)words()
+					&& posting_size(word->first) > 0)
+				{
+					batch_term_t term = {word->first, q, 2.0f * word->second};
+					terms.push_back(term);
+				}
+			}
+		}
+		std::sort(terms.begin(), terms.end());
+		groups.clear();
+		weights.clear();
+		for (size_t i = 0; i < terms.size(); ++i) {
+			if (i == 0 || terms[i].word_id != terms[i - 1].word_id) {
+				batch_group_t group;
+				group.cur = m_postings.data() + m_offsets[terms[i].word_id];
+				group.end = m_postings.data() + m_offsets[terms[i].word_id + 1];
+				group.term_begin = i;
+				group.queries = 0;
+				groups.push_back(group);
+				weights.resize(weights.size() + BATCH_SIZE, 0.0f);
+			}
+			groups.back().term_end = i + 1;
+			groups.back().queries |= 1u << terms[i].query;
+			weights[weights.size() - BATCH_SIZE + terms[i].query] = terms[i].weight;
+		}
+		
+		for (int tile = 0; tile < (int)m_docs; tile += TILE_SIZE) {
+			int tile_end = std::min(tile + TILE_SIZE, (int)m_docs);
+			
+			for (size_t g = 0; g < groups.size(); ++g) {
+				batch_group_t &group = groups[g];
+				const inverted_index_word_t *doc = group.cur;
+				
+				if (group.term_end - group.term_begin == 1) {
+					const batch_term_t &term = terms[group.term_begin];
+					for (; doc != group.end && doc->doc_id < tile_end; ++doc) {
+						int row = doc->doc_id - tile;
+						hit[row] |= group.queries;
+						scores[row * BATCH_SIZE + term.query] += term.weight * doc->value;
+					}
+				} else {
+					// shared word: update the whole row, the weight of
+					// the other queries is 0
+					const float *w = weights.data() + g * BATCH_SIZE;
+					for (; doc != group.end && doc->doc_id < tile_end; ++doc) {
+						int row = doc->doc_id - tile;
+						float *row_scores = scores.data() + row * BATCH_SIZE;
+						hit[row] |= group.queries;
+						for (int q = 0; q < BATCH_SIZE; ++q) {
+							row_scores[q] += w[q] * doc->value;
+						}
+					}
+				}
+				group.cur = doc;
+			}
+			for (int row = 0; row < tile_end - tile; ++row) {
+				float *row_scores = scores.data() + row * BATCH_SIZE;
+				for (uint32_t mask = hit[row]; mask != 0; mask &= mask - 1) {
+					int q = __builtin_ctz(mask);
+					topn_push(context.m_batch_topn[q], k, tile + row, row_scores[q]);
+					row_scores[q] = 0.0f;
+				}
+				hit[row] = 0;
+			}
+		}
+		for (int q = 0; q < n; ++q) {
+			topn_convert(results[q], context.m_batch_topn[q]);
+		}
+	}
+	
+	// score of doc_id summed in query order, the same value as knn()
+	inline float
+	exact_score(const fv_t &query, int doc_id) const
+	{
+		float score = 0.0f;
+		
+		for (auto word = query.begin(); word != query.end(); ++word) {
+			if (word->first >= 0 && word->first < (int)words()) {
+				float query_w = 2.0f * word->second;
+				const inverted_index_word_t *begin = m_postings.data() + m_offsets[word->first];
+				const inverted_index_word_t *end = m_postings.data() + m_offsets[word->first + 1];
+				const inverted_index_word_t *doc = std::lower_bound(begin, end,
+																	inverted_index_word_t(doc_id, 0.0f));
+				if (doc != end && doc->doc_id == doc_id) {
+					score += query_w * doc->value;
+				}
+			}
+		}
+		return score;
+	}
+	
+	// k-th largest score of ids
+	static float
+	kth_score(std::vector<float> &work,
+			  const std::vector<int> &ids,
+			  const std::vector<float> &scores,
+			  size_t k)
+	{
+		work.clear();
+		for (auto id = ids.begin(); id != ids.end(); ++id) {
+			work.push_back(scores[*id]);
+		}
+		std::nth_element(work.begin(), work.begin() + (k - 1), work.end(),
+						 std::greater<float>());
+		return work[k - 1];
+	}
+	
 public:
-	InvertedIndex() {}
+	InvertedIndex() : m_docs(0), m_nonnegative(true), m_compressed(false), m_data(0) {}
 	
+	// compressed: store the postings with CompressedPostings
+	// (delta coded ids, 8-bit quantized values). knn() and fast_knn()
+	// then rank by approximate scores; maxscore_knn() falls back to knn().
 	void
-	build(const std::vector<fv_t> *data)
+	build(const std::vector<fv_t> *data, bool compressed = false)
 	{
-		m_data = data;
+		int max_word_id = -1;
+		std::vector<size_t> pos;
+		TraceSpan span("InvertedIndex::build", data->size());
 		
 		clear();
+		m_data = data;
+		m_docs = data->size();
+		
 		for (size_t id = 0; id < m_data->size(); ++id) {
-			this->set(id, m_data->at(id));
+			const fv_t &fv = m_data->at(id);
+			if (!fv.empty()) {
+				max_word_id = std::max(max_word_id, fv.back().first);
+			}
 		}
+		m_offset_buffer.assign(max_word_id + 2, 0);
+		m_max_value_buffer.assign(max_word_id + 1, 0.0f);
+		for (size_t id = 0; id < m_data->size(); ++id) {
+			const fv_t &fv = m_data->at(id);
+			for (auto word = fv.begin(); word != fv.end(); ++word) {
+				if (word->first >= 0) {
+					m_offset_buffer[word->first + 1] += 1;
+				}
+			}
+		}
+		for (size_t w = 0; w + 1 < m_offset_buffer.size(); ++w) {
+			m_offset_buffer[w + 1] += m_offset_buffer[w];
+		}
+		use_buffers();
+		if (compressed) {
+			m_compressed = true;
+			build_compressed();
+			return;
+		}
+		m_posting_buffer.resize(m_offsets[words()]);
+		pos.assign(m_offsets.begin(), m_offsets.end() - 1);
+		for (size_t id = 0; id < m_data->size(); ++id) {
+			const fv_t &fv = m_data->at(id);
+			for (auto word = fv.begin(); word != fv.end(); ++word) {
+				if (word->first >= 0) {
+					m_posting_buffer[pos[word->first]++] = inverted_index_word_t(id, word->second);
+				}
+			}
+		}
+		use_buffers();
+		build_blocks();
 	}
 	void
 	clear()
 	{
-		m_inverted_index.clear();
+		m_offset_buffer.assign(1, 0);
+		m_posting_buffer.clear();
+		m_block_offset_buffer.assign(1, 0);
+		m_block_buffer.clear();
+		m_max_value_buffer.clear();
+		use_buffers();
+		m_docs = 0;
+		m_data = 0;
+		m_nonnegative = true;
+		m_compressed = false;
+		m_compressed_postings.clear();
 	}
+	
+	// forgets the data vectors given to build(), for callers that do not
+	// keep them. fast_knn() is not available after this.
 	void
-	set(unsigned int id, const fv_t &fv)
+	release_data(void)
 	{
-		for (fv_t::const_iterator word = fv.begin(); word != fv.end(); ++word) {
-			if (word->first >= (int)m_inverted_index.size()) {
-				m_inverted_index.resize(word->first + 1);
-			}
-			m_inverted_index[word->first].push_back(inverted_index_word_t(id, word->second));
+		m_data = 0;
+	}
+	inline size_t
+	docs(void) const
+	{
+		return m_docs;
+	}
+	inline bool
+	compressed(void) const
+	{
+		return m_compressed;
+	}
+	// heap bytes of the postings built by build(). an attached index
+	// is counted with the file it is attached to.
+	size_t
+	memory_usage(void) const
+	{
+		return ::memory_usage(m_offset_buffer)
+			+ ::memory_usage(m_posting_buffer)
+			+ ::memory_usage(m_block_offset_buffer)
+			+ ::memory_usage(m_block_buffer)
+			+ ::memory_usage(m_max_value_buffer)
+			+ m_compressed_postings.memory_usage();
+	}
+	
+	// writes the index as a file section at the current position of fp,
+	// which must be 8-byte aligned
+	bool
+	write(FILE *fp) const
+	{
+		file_header_t header;
+		bool ok = true;
+		
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, "LSHTCIDX", 8);
+		header.version = FILE_VERSION;
+		header.nonnegative = m_nonnegative ? 1 : 0;
+		header.docs = m_docs;
+		header.words = words();
+		header.postings = m_postings.size();
+		header.blocks = m_blocks.size();
+		header.offsets = MappedFile::align8(sizeof(header));
+		header.posting_data = MappedFile::align8(header.offsets + m_offsets.size() * sizeof(uint64_t));
+		header.block_offsets = MappedFile::align8(header.posting_data + m_postings.size() * sizeof(inverted_index_word_t));
+		header.block_data = MappedFile::align8(header.block_offsets + m_block_offsets.size() * sizeof(uint64_t));
+		header.max_values = MappedFile::align8(header.block_data + m_blocks.size() * sizeof(inverted_index_block_t));
+		header.size = MappedFile::align8(header.max_values + m_max_values.size() * sizeof(float));
+		if (m_compressed) {
+			header.compressed = header.size;
+		}
+		
+		// the size of the compressed section is known after writing it
+		ok &= std::fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok &= MappedFile::write_padding(fp, sizeof(header));
+		ok &= std::fwrite(m_offsets.data(), sizeof(uint64_t), m_offsets.size(), fp) == m_offsets.size();
+		ok &= std::fwrite(m_postings.data(), sizeof(inverted_index_word_t), m_postings.size(), fp) == m_postings.size();
+		ok &= std::fwrite(m_block_offsets.data(), sizeof(uint64_t), m_block_offsets.size(), fp) == m_block_offsets.size();
+		ok &= std::fwrite(m_blocks.data(), sizeof(inverted_index_block_t), m_blocks.size(), fp) == m_blocks.size();
+		ok &= std::fwrite(m_max_values.data(), sizeof(float), m_max_values.size(), fp) == m_max_values.size();
+		ok &= MappedFile::write_padding(fp, header.max_values + m_max_values.size() * sizeof(float));
+		if (ok && m_compressed) {
+			long start = std::ftell(fp) - (long)header.size;
+			ok &= m_compressed_postings.write(fp);
+			header.size = (uint64_t)(std::ftell(fp) - start);
+			ok &= std::fseek(fp, start, SEEK_SET) == 0;
+			ok &= std::fwrite(&header, sizeof(header), 1, fp) == 1;
+			ok &= std::fseek(fp, 0, SEEK_END) == 0;
 		}
+		
+		return ok;
 	}
-	void
-	fast_knn(result_t &results,
+	
+	// uses a section written by write() in place. data must be 8-byte
+	// aligned and stay mapped while the index is used.
+	// returns the size of the section, or 0 when it is invalid.
+	// fast_knn() is not available (no data vectors).
+	size_t
+	attach(const char *data, size_t size)
+	{
+		const file_header_t *header = (const file_header_t *)data;
+		
+		uint64_t compressed;
+		uint64_t block_offsets;
+		
+		clear();
+		if (size < sizeof(file_header_t)
+			|| std::memcmp(header->magic, "LSHTCIDX", 8) != 0
+			|| header->version < 1 || header->version > FILE_VERSION)
+		{
+			return 0;
+		}
+		compressed = header->version >= 2 ? header->compressed : 0;
+		block_offsets = compressed ? 1 : header->words + 1;
+		if (header->size > size
+			|| header->words + 1 == 0
+			|| header->offsets < sizeof(file_header_t)
+			|| !MappedFile::section_fits(header->offsets, header->words + 1, sizeof(uint64_t), header->posting_data)
+			|| !MappedFile::section_fits(header->posting_data, header->postings, sizeof(inverted_index_word_t),
+										 header->block_offsets)
+			|| !MappedFile::section_fits(header->block_offsets, block_offsets, sizeof(uint64_t), header->block_data)
+			|| !MappedFile::section_fits(header->block_data, header->blocks, sizeof(inverted_index_block_t),
+										 header->max_values)
+			|| !MappedFile::section_fits(header->max_values, header->words, sizeof(float),
+										 compressed ? compressed : header->size)
+			|| (compressed && (compressed > header->size || compressed % 8 != 0
+							   || m_compressed_postings.attach(data + compressed,
+															   (size_t)(header->size - compressed)) == 0
+							   || m_compressed_postings.size() != header->words)))
+		{
+			clear();
+			return 0;
+		}
+		m_offsets.set((const uint64_t *)(data + header->offsets), header->words + 1);
+		m_postings.set((const inverted_index_word_t *)(data + header->posting_data), header->postings);
+		m_block_offsets.set((const uint64_t *)(data + header->block_offsets), block_offsets);
+		m_blocks.set((const inverted_index_block_t *)(data + header->block_data), header->blocks);
+		m_max_values.set((const float *)(data + header->max_values), header->words);
+		m_compressed = compressed != 0;
+		m_docs = header->docs;
+		m_nonnegative = header->nonnegative != 0;
+		if (header->docs > (uint64_t)INT_MAX || !lists_valid()) {
+			clear();
+			return 0;
+		}
+		
+		return header->size;
+	}
+	// returns false, with no results, when the index has no data vectors
+	// (after attach() or release_data())
+	bool
+	fast_knn(SearchContext &context,
+			 result_t &results,
 			 size_t k,
-			 const fv_t &fv,
+			 const fv_t &query,
 			 size_t first_k,
 			 size_t first_truncate_threshold) const
 	{
+		if (m_data == 0) {
+			results.clear();
+			return false;
+		}
 		// knn using few features
-		fv_t query = fv;
-		fv_t query_first = truncate_query(query, first_truncate_threshold);
-		this->knn(results, first_k, query_first);
+		truncate_query(context.m_query, query, first_truncate_threshold);
+		this->knn(context, results, first_k, context.m_query);
 		if (results.size() == 0) {
-			this->knn(results, k, query);
+			this->knn(context, results, k, query);
 		}
 		
 		/* knn using full features */
-		size_t threads = processor_count();
-		topn_t topn[threads];
-		
-#ifdef _OPENMP
-#pragma omp parallel for num_threads(threads)
-#endif
-		for (int i = 0; i < (int)results.size(); ++i) {
-			size_t thread_id = processor_id();
-			topn_push(topn[thread_id], k,
-					  results[i].id,
-					  fv_cosine(query, m_data->at(results[i].id)));
+		// the terms of the data vectors are in [0, words()), so each
+		// candidate is a sparse-dense dot with the scattered query
+		std::vector<result_element_t> &topn = context.m_topn;
+		std::vector<float> &dense = context.m_dense_query;
+		if (dense.size() < words()) {
+			dense.resize(words(), 0.0f);
 		}
-		for (size_t i = 1; i < threads; ++i) {
-			while (!topn[i].empty()) {
-				const result_element_t &elm = topn[i].top();
-				topn_push(topn[0], k, elm.id, elm.cosine);
-				topn[i].pop();
+		for (auto word = query.begin(); word != query.end(); ++word) {
+			if (word->first >= 0 && word->first < (int)words()) {
+				dense[word->first] = word->second;
 			}
 		}
-		results.clear();
-		topn_convert(results, k, topn[0]);
+		for (auto i = results.begin(); i != results.end(); ++i) {
+			const fv_t &fv = m_data->at(i->id);
+			topn_push(topn, k, i->id, 2.0f * sparse_dot(dense.data(), fv.data(), fv.size()));
+		}
+		for (auto word = query.begin(); word != query.end(); ++word) {
+			if (word->first >= 0 && word->first < (int)words()) {
+				dense[word->first] = 0.0f;
+			}
+		}
+		topn_convert(results, topn);
+		
+		return true;
+	}
+	bool
+	fast_knn(result_t &results,
+			 size_t k,
+			 const fv_t &query,
+			 size_t first_k,
+			 size_t first_truncate_threshold) const
+	{
+		SearchContext context;
+		return fast_knn(context, results, k, query, first_k, first_truncate_threshold);
 	}
 	
+	// exhaustive term-at-a-time search
+	void
+	knn(SearchContext &context,
+		result_t &results,
+		size_t k,
+		const fv_t &query) const
+	{
+		std::vector<float> &scores = context.m_scores;
+		std::vector<char> &hit = context.m_hit;
+		std::vector<int> &hits = context.m_hits;
+		std::vector<result_element_t> &topn = context.m_topn;
+		
+		context.reserve(m_docs);
+		for (auto word = query.begin(); word != query.end(); ++word) {
+			if (word->first >= 0 && word->first < (int)words()) {
+				float query_w = 2.0f * word->second;
+				if (m_compressed) {
+					CompressedPostings::Decoder decoder = m_compressed_postings.decoder(word->first);
+					int ids[CompressedPostings::BLOCK_SIZE];
+					float values[CompressedPostings::BLOCK_SIZE];
+					size_t n;
+					while ((n = decoder.next(ids, values)) > 0) {
+						for (size_t i = 0; i < n; ++i) {
+							if (!hit[ids[i]]) {
+								hit[ids[i]] = 1;
+								hits.push_back(ids[i]);
+							}
+							scores[ids[i]] += query_w * values[i];
+						}
+					}
+				} else {
+					const inverted_index_word_t *doc = m_postings.data() + m_offsets[word->first];
+					const inverted_index_word_t *end = m_postings.data() + m_offsets[word->first + 1];
+					for (; doc != end; ++doc) {
+						if (!hit[doc->doc_id]) {
+							hit[doc->doc_id] = 1;
+							hits.push_back(doc->doc_id);
+						}
+						scores[doc->doc_id] += query_w * doc->value;
+					}
+				}
+			}
+		}
+		for (auto id = hits.begin(); id != hits.end(); ++id) {
+			topn_push(topn, k, *id, scores[*id]);
+			scores[*id] = 0.0f;
+			hit[*id] = 0;
+		}
+		hits.clear();
+		topn_convert(results, topn);
+	}
 	void
 	knn(result_t &results,
 		size_t k,
 		const fv_t &query) const
 	{
-		int num_threads = processor_count();
-		std::vector<std::vector<word_result_t> > hits;
-		std::vector<std::pair<unsigned int, float> > fv;
-		topn_t topn;
+		SearchContext context;
+		knn(context, results, k, query);
+	}
+	
+	// Batched knn(): results[i] = knn(queries[i]) for n queries.
+	// The queries are processed in blocks of BATCH_SIZE. The words of a
+	// block are grouped so that each posting list is read once per block,
+	// and the scores are accumulated into a TILE_SIZE docs x BATCH_SIZE
+	// queries tile that stays in cache (a tiled sparse x sparse^T product).
+	// Scores are summed in the same order as knn(), so the results match.
+	void
+	knn_batch(SearchContext &context,
+			  std::vector<result_t> &results,
+			  size_t k,
+			  const fv_t *queries,
+			  size_t n) const
+	{
+		results.resize(n);
+		if (m_compressed) {
+			for (size_t i = 0; i < n; ++i) {
+				knn(context, results[i], k, queries[i]);
+			}
+			return;
+		}
+		context.reserve_batch();
+		for (size_t i = 0; i < n; i += BATCH_SIZE) {
+			knn_block(context, results.data() + i, k,
+					  queries + i, std::min(n - i, (size_t)BATCH_SIZE));
+		}
+	}
+	
+	// Term-at-a-time search with MaxScore and block-max pruning.
+	// Returns the same top-k and scores as knn(): theta is kept below the
+	// k-th score by order_slack(), and the final top-k is summed again in
+	// query order.
+	// Words are processed in decreasing order of their upper bound. Once
+	// the upper bound of the remaining words falls below the k-th best
+	// partial score, documents not seen so far cannot enter the top-k, so
+	// the remaining (long, low impact) posting lists are only probed for
+	// the surviving candidates, skipping whole blocks by their max value.
+	void
+	maxscore_knn(SearchContext &context,
+				 result_t &results,
+				 size_t k,
+				 const fv_t &query) const
+	{
+		std::vector<float> &scores = context.m_scores;
+		std::vector<char> &hit = context.m_hit;
+		std::vector<int> &hits = context.m_hits;
+		std::vector<result_element_t> &topn = context.m_topn;
+		std::vector<posting_cursor_t> &cursors = context.m_cursors;
+		std::vector<int> &candidates = context.m_candidates;
+		std::vector<float> &rest = context.m_rest;
+		std::vector<size_t> &rest_postings = context.m_rest_postings;
+		float theta = -FLT_MAX;
+		size_t scanned = 0;
+		bool sorted;
+		size_t i;
 		
-		for (fv_t::const_iterator i = query.begin();
-			 i != query.end();
-			 ++i)
-		{
-			fv.push_back(std::make_pair(i->first, i->second));
+		if (!m_nonnegative || m_compressed || k == 0) {
+			knn(context, results, k, query);
+			return;
+		}
+		cursors.clear();
+		for (auto word = query.begin(); word != query.end(); ++word) {
+			if (word->first >= 0 && word->first < (int)words()
+				&& posting_size(word->first) > 0)
+			{
+				posting_cursor_t c;
+				if (word->second < 0.0f) {
+					knn(context, results, k, query);
+					return;
+				}
+				c.begin = c.cur = m_postings.data() + m_offsets[word->first];
+				c.end = m_postings.data() + m_offsets[word->first + 1];
+				c.blocks = m_blocks.data() + m_block_offsets[word->first];
+				c.weight = 2.0f * word->second;
+				c.upper_bound = c.weight * m_max_values[word->first] * bound_slack();
+				cursors.push_back(c);
+			}
 		}
+		std::sort(cursors.begin(), cursors.end(), std::greater<posting_cursor_t>());
+		// rest[i]: upper bound of the score from cursors[i..]
+		rest.assign(cursors.size() + 1, 0.0f);
+		rest_postings.assign(cursors.size() + 1, 0);
+		for (i = cursors.size(); i-- > 0;) {
+			rest[i] = rest[i + 1] + cursors[i].upper_bound;
+			rest_postings[i] = rest_postings[i + 1] + cursors[i].size();
+		}
+		context.reserve(m_docs);
 		
-		hits.resize(num_threads);
-		hits[0].reserve(m_data->size() / 4 + 1);
-		for (int i = 1; i < num_threads; ++i) {
-			hits[i].reserve(m_data->size() / 4 / num_threads + 1);
+		// accumulate until unseen documents can no longer enter the top-k
+		// and only a small part of the seen documents can
+		candidates.clear();
+		for (i = 0; i < cursors.size(); ++i) {
+			const posting_cursor_t &c = cursors[i];
+			// theta costs O(hits), so it is only computed when it can
+			// exceed the remaining bound (theta <= rest[0] - rest[i]), after
+			// enough postings have been scanned to pay for it, and when
+			// the remaining lists are long enough to be worth skipping.
+			if (hits.size() >= k && rest[i] < rest[0] - rest[i]
+				&& scanned >= 16 * hits.size()
+				&& rest_postings[i] > 4 * hits.size())
+			{
+				scanned = 0;
+				theta = kth_score(context.m_work, hits, scores, k) / order_slack();
+				if (rest[i] < theta) {
+					for (auto id = hits.begin(); id != hits.end(); ++id) {
+						if (scores[*id] + rest[i] >= theta) {
+							candidates.push_back(*id);
+						}
+					}
+					if (candidates.size() * 4 < hits.size()) {
+						break;
+					}
+					candidates.clear();
+				}
+			}
+			for (const inverted_index_word_t *doc = c.begin; doc != c.end; ++doc) {
+				if (!hit[doc->doc_id]) {
+					hit[doc->doc_id] = 1;
+					hits.push_back(doc->doc_id);
+				}
+				scores[doc->doc_id] += c.weight * doc->value;
+			}
+			scanned += c.size();
 		}
-#ifdef _OPENMP
-#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 4)
-#endif
-		for (int i = 0; i < (int)fv.size(); ++i) {
-			int thread_id = processor_id();
-			float query_w = 2.0f * fv[i].second;
+		
+		// complete the scores of the candidates
+		sorted = false;
+		scanned = 0;
+		for (; i < cursors.size() && !candidates.empty(); ++i) {
+			posting_cursor_t &c = cursors[i];
+			size_t n = 0;
 			
-			std::vector<word_result_t> &hit = hits[thread_id];
-			if (fv[i].first < m_inverted_index.size()) {
-				const inverted_index_doc_t &ids = m_inverted_index[fv[i].first];
-				for (inverted_index_doc_t::const_iterator doc = ids.begin();
-					 doc != ids.end();
-					 ++doc)
-				{
-					hit.push_back(word_result_t(doc->doc_id, query_w * doc->value));
+			if (candidates.size() * 8 > c.size()) {
+				// many candidates: accumulate the whole list as knn() does,
+				// only documents seen before can still be candidates
+				for (const inverted_index_word_t *doc = c.cur; doc != c.end; ++doc) {
+					if (hit[doc->doc_id]) {
+						scores[doc->doc_id] += c.weight * doc->value;
+					}
+				}
+				scanned += c.size();
+				if (scanned < 4 * candidates.size()) {
+					continue;
+				}
+				for (auto id = candidates.begin(); id != candidates.end(); ++id) {
+					if (scores[*id] + rest[i + 1] >= theta) {
+						candidates[n++] = *id;
+					}
+				}
+			} else {
+				if (!sorted) {
+					std::sort(candidates.begin(), candidates.end());
+					sorted = true;
+				}
+				for (auto id = candidates.begin(); id != candidates.end(); ++id) {
+					float &score = scores[*id];
+					if (cursor_seek(c, *id, score + rest[i + 1], theta)) {
+						if (c.cur != c.end && c.cur->doc_id == *id) {
+							score += c.weight * c.cur->value;
+						}
+						if (score + rest[i + 1] >= theta) {
+							candidates[n++] = *id;
+						}
+					}
 				}
+				scanned += candidates.size();
+			}
+			candidates.resize(n);
+			if (candidates.size() >= k && scanned >= 4 * candidates.size()) {
+				scanned = 0;
+				theta = std::max(theta, kth_score(context.m_work, candidates, scores, k) / order_slack());
 			}
 		}
-		for (int i = 1; i < num_threads; ++i) {
-			std::copy(hits[i].begin(), hits[i].end(), std::back_inserter(hits[0]));
+		if (candidates.empty()) {
+			candidates.swap(hits);
 		}
-		std::sort(hits[0].begin(), hits[0].end());
-		if (hits[0].size() > 0) {
-			int id = hits[0][0].id;
-			float cosine = 0.0f;
-			std::vector<word_result_t> &hit = hits[0];
-			for (auto j = hit.begin(); j != hit.end(); ++j)	{
-				if (j->id == id) {
-					cosine += j->dot;
-				} else {
-					topn_push(topn, k, id, cosine);
-					id = j->id;
-					cosine = j->dot;
-				}
+		// the sums above are in upper bound order. the top-k of knn() is
+		// within order_slack() of the k-th of them, and is summed again
+		// in query order, so that the results are the same as knn()
+		for (auto id = candidates.begin(); id != candidates.end(); ++id) {
+			topn_push(topn, k, *id, scores[*id]);
+		}
+		float kth = topn.size() < k ? -FLT_MAX : topn.front().cosine;
+		topn.clear();
+		for (auto id = candidates.begin(); id != candidates.end(); ++id) {
+			if (scores[*id] * order_slack() >= kth) {
+				topn_push(topn, k, *id, exact_score(query, *id));
 			}
-			topn_push(topn, k, id, cosine);
 		}
-		topn_convert(results, k, topn);
+		
+		for (auto id = hits.begin(); id != hits.end(); ++id) {
+			scores[*id] = 0.0f;
+			hit[*id] = 0;
+		}
+		for (auto id = candidates.begin(); id != candidates.end(); ++id) {
+			scores[*id] = 0.0f;
+			hit[*id] = 0;
+		}
+		hits.clear();
+		candidates.clear();
+		topn_convert(results, topn);
 	}
 };
 
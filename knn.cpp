@@ -9,6 +9,9 @@
 #define K              12
 #define K_FIRST        3000
 #define PREDICT_LABEL  5
+#ifndef COMPRESSED
+#  define COMPRESSED   0  /* 1 = compressed posting lists (8-bit values, results may change) */
+#endif
 
 static void
 predict(std::vector<int> &results,
@@ -95,29 +98,35 @@ int main(void)
 	tfidf.train(data);
 	tfidf.transform(data);
 	tfidf.transform(test_data);
-	knn.build(&data);
+	knn.build(&data, COMPRESSED != 0);
 	printf("build index %ldms\n", tick() -t );
 	
 	t = tick();
 	
 #ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 1)
+#pragma omp parallel
+#endif
+	{
+		InvertedIndex::SearchContext context;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
 #endif
-	for (int i = 0; i < (int)test_data.size(); ++i) {
-		std::vector<int> topn_labels;
-		InvertedIndex::result_t results;
-		
-		knn.fast_knn(results, K, test_data[i], K_FIRST, data.size() / 100);
-		predict(topn_labels, results, labels);
-		
+		for (int i = 0; i < (int)test_data.size(); ++i) {
+			std::vector<int> topn_labels;
+			InvertedIndex::result_t results;
+			
+			knn.fast_knn(context, results, K, test_data[i], K_FIRST, data.size() / 100);
+			predict(topn_labels, results, labels);
+			
 #ifdef _OPENMP
 #pragma omp critical
 #endif
-		{
-			submission.push_back(std::make_pair(i, topn_labels));			
-			if (i % 1000 == 0) {
-				printf("--- predict %d/%ld %ldms\n", i, test_data.size(), tick() -t);
-				t = tick();
+			{
+				submission.push_back(std::make_pair(i, topn_labels));			
+				if (i % 1000 == 0) {
+					printf("--- predict %d/%ld %ldms\n", i, test_data.size(), tick() -t);
+					t = tick();
+				}
 			}
 		}
 	}
@@ -0,0 +1,206 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Read-only memory mapped file
+class MappedFile
+{
+private:
+	const char *m_data;
+	size_t m_size;
+
+	MappedFile(const MappedFile &);
+	MappedFile &operator=(const MappedFile &);
+
+public:
+	MappedFile() : m_data(0), m_size(0) {}
+	~MappedFile()
+	{
+		close();
+	}
+
+	bool
+	open(const char *file, bool sequential = false)
+	{
+		struct stat st;
+		int fd;
+
+		close();
+		fd = ::open(file, O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		if (fstat(fd, &st) != 0) {
+			::close(fd);
+			return false;
+		}
+		m_size = (size_t)st.st_size;
+		if (m_size > 0) {
+			void *p = mmap(0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				::close(fd);
+				m_size = 0;
+				return false;
+			}
+			m_data = (const char *)p;
+			if (sequential) {
+				madvise(p, m_size, MADV_SEQUENTIAL);
+			}
+		}
+		::close(fd);
+
+		return true;
+	}
+
+	void
+	close(void)
+	{
+		if (m_data != 0) {
+			munmap((void *)m_data, m_size);
+		}
+		m_data = 0;
+		m_size = 0;
+	}
+
+	inline bool
+	is_open(void) const
+	{
+		return m_data != 0;
+	}
+	inline const char *
+	data(void) const
+	{
+		return m_data;
+	}
+	inline size_t
+	size(void) const
+	{
+		return m_size;
+	}
+	
+	// helpers for writing files with 8-byte aligned sections
+	static inline uint64_t
+	align8(uint64_t offset)
+	{
+		return (offset + 7) & ~(uint64_t)7;
+	}
+	static bool
+	write_padding(FILE *fp, uint64_t offset)
+	{
+		static const char zero[8] = {0};
+		size_t n = (size_t)(align8(offset) - offset);
+		return n == 0 || std::fwrite(zero, 1, n, fp) == n;
+	}
+	
+	// and for reading them
+	// count elements of elem_size at offset fit in [offset, limit)
+	static inline bool
+	section_fits(uint64_t offset, uint64_t count, size_t elem_size, uint64_t limit)
+	{
+		return offset % elem_size == 0 && offset <= limit
+			&& count <= (limit - offset) / elem_size;
+	}
+	// row offsets of a CSR section: offsets[0] = 0, nondecreasing,
+	// offsets[rows] = nnz
+	static bool
+	offsets_valid(const uint64_t *offsets, uint64_t rows, uint64_t nnz)
+	{
+		if (offsets[0] != 0 || offsets[rows] != nnz) {
+			return false;
+		}
+		for (uint64_t i = 0; i < rows; ++i) {
+			if (offsets[i] > offsets[i + 1]) {
+				return false;
+			}
+		}
+		return true;
+	}
+	// ids index arrays, so they are not negative
+	static bool
+	ids_valid(const int32_t *ids, uint64_t n)
+	{
+		for (uint64_t i = 0; i < n; ++i) {
+			if (ids[i] < 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+	// sorted ids (binary searched or merged), strictly increasing
+	static bool
+	ids_increasing(const int32_t *ids, uint64_t n)
+	{
+		for (uint64_t i = 1; i < n; ++i) {
+			if (ids[i - 1] >= ids[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// Read-only array that points into a MappedFile or a std::vector
+template<typename T>
+class MappedArray
+{
+private:
+	const T *m_data;
+	size_t m_size;
+	
+public:
+	MappedArray() : m_data(0), m_size(0) {}
+	
+	void
+	set(const T *data, size_t size)
+	{
+		m_data = data;
+		m_size = size;
+	}
+	void
+	set(const std::vector<T> &vec)
+	{
+		set(vec.data(), vec.size());
+	}
+	
+	inline const T &
+	operator[](size_t i) const
+	{
+		return m_data[i];
+	}
+	inline const T *
+	data(void) const
+	{
+		return m_data;
+	}
+	inline size_t
+	size(void) const
+	{
+		return m_size;
+	}
+	inline bool
+	empty(void) const
+	{
+		return m_size == 0;
+	}
+	inline const T *
+	begin(void) const
+	{
+		return m_data;
+	}
+	inline const T *
+	end(void) const
+	{
+		return m_data + m_size;
+	}
+};
+
+#endif
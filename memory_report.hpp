@@ -0,0 +1,74 @@
+#ifndef MEMORY_REPORT_HPP
+#define MEMORY_REPORT_HPP
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// Memory breakdown of a program phase
+//
+// add() the memory_usage() of each structure, then print() writes them
+// with their total, the resident set size and the peak resident set size
+// of the process so far.
+class MemoryReport
+{
+private:
+	std::vector<std::pair<std::string, size_t> > m_items;
+
+	// current resident set size from /proc/self/statm, 0 when unavailable
+	static size_t
+	rss(void)
+	{
+		FILE *fp = std::fopen("/proc/self/statm", "r");
+		unsigned long pages = 0, resident = 0;
+
+		if (fp == 0) {
+			return 0;
+		}
+		if (std::fscanf(fp, "%lu %lu", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		std::fclose(fp);
+		return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+	}
+	static size_t
+	peak_rss(void)
+	{
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0) {
+			return 0;
+		}
+		return (size_t)usage.ru_maxrss * 1024; // kilobytes on Linux
+	}
+
+public:
+	void
+	add(const char *name, size_t bytes)
+	{
+		m_items.push_back(std::make_pair(std::string(name), bytes));
+	}
+
+	void
+	print(FILE *fp, const char *name, const char *phase) const
+	{
+		const double MB = 1024.0 * 1024.0;
+		size_t total = 0;
+
+		std::fprintf(fp, "%s: memory after %s\n", name, phase);
+		for (auto i = m_items.begin(); i != m_items.end(); ++i) {
+			std::fprintf(fp, "  %-20s %12.1fMB\n", i->first.c_str(), i->second / MB);
+			total += i->second;
+		}
+		std::fprintf(fp, "  %-20s %12.1fMB\n", "total", total / MB);
+		size_t resident = rss();
+		
+		std::fprintf(fp, "  %-20s %12.1fMB\n", "rss", resident / MB);
+		// ru_maxrss is updated lazily and may lag behind statm
+		std::fprintf(fp, "  %-20s %12.1fMB\n", "peak rss",
+					 std::max(resident, peak_rss()) / MB);
+	}
+};
+
+#endif
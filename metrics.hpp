@@ -0,0 +1,246 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include "util.hpp"
+#include "tick.hpp"
+
+// Latency histogram
+//
+// Bucket i < 8 holds the value i, above that each power of two is split
+// into 8 buckets, so a percentile is within 12.5% of the exact value.
+class Histogram
+{
+public:
+	static const int SUB_BITS = 3;
+	static const int SUB_BUCKETS = 1 << SUB_BITS;
+	static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+private:
+	uint64_t m_buckets[BUCKETS];
+	uint64_t m_count;
+	uint64_t m_sum;
+	uint64_t m_max;
+
+	static inline int
+	bucket(uint64_t value)
+	{
+		if (value < (uint64_t)SUB_BUCKETS) {
+			return (int)value;
+		}
+		int e = 63 - __builtin_clzll(value);
+		return (e - SUB_BITS + 1) * SUB_BUCKETS
+			+ (int)((value >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+	}
+	// the middle of bucket i
+	static inline uint64_t
+	value(int i)
+	{
+		if (i < SUB_BUCKETS) {
+			return (uint64_t)i;
+		}
+		int e = i / SUB_BUCKETS + SUB_BITS - 1;
+		uint64_t low = (uint64_t)(SUB_BUCKETS + i % SUB_BUCKETS) << (e - SUB_BITS);
+		return low + ((uint64_t)1 << (e - SUB_BITS)) / 2;
+	}
+
+public:
+	Histogram()
+	{
+		clear();
+	}
+
+	void
+	clear(void)
+	{
+		std::memset(m_buckets, 0, sizeof(m_buckets));
+		m_count = m_sum = m_max = 0;
+	}
+	inline void
+	record(uint64_t value)
+	{
+		m_buckets[bucket(value)] += 1;
+		m_count += 1;
+		m_sum += value;
+		if (value > m_max) {
+			m_max = value;
+		}
+	}
+	void
+	merge(const Histogram &h)
+	{
+		for (int i = 0; i < BUCKETS; ++i) {
+			m_buckets[i] += h.m_buckets[i];
+		}
+		m_count += h.m_count;
+		m_sum += h.m_sum;
+		m_max = std::max(m_max, h.m_max);
+	}
+
+	uint64_t
+	count(void) const
+	{
+		return m_count;
+	}
+	uint64_t
+	sum(void) const
+	{
+		return m_sum;
+	}
+	uint64_t
+	max(void) const
+	{
+		return m_max;
+	}
+	// p in [0, 1]
+	uint64_t
+	percentile(double p) const
+	{
+		uint64_t rank = (uint64_t)(p * m_count);
+		uint64_t n = 0;
+
+		if (m_count == 0) {
+			return 0;
+		}
+		if (rank >= m_count) {
+			rank = m_count - 1;
+		}
+		for (int i = 0; i < BUCKETS; ++i) {
+			n += m_buckets[i];
+			if (n > rank) {
+				return std::min(value(i), m_max);
+			}
+		}
+		return m_max;
+	}
+};
+
+// Per-stage latency and throughput of a program
+//
+// record() adds the time of one call of a stage and the number of
+// documents (or other items) it processed. Each thread records into its
+// own histograms (by ThreadSlot), so record() does not lock; summary()
+// merges them and must not run concurrently with record().
+class Metrics
+{
+public:
+	enum stage_t {
+		PARSE,
+		TRANSFORM,
+		BUILD,     // index and model building
+		SEARCH,    // centroid search
+		SCORE,     // binary classifier scoring
+		TRAIN,     // binary classifier training
+		OUTPUT,
+		STAGES
+	};
+
+	// records the time from construction to destruction
+	class Timer
+	{
+		Metrics &m_metrics;
+		stage_t m_stage;
+		uint64_t m_items;
+		uint64_t m_start;
+	public:
+		Timer(Metrics &metrics, stage_t stage, uint64_t items = 1)
+			: m_metrics(metrics), m_stage(stage), m_items(items), m_start(tick_ns())
+		{}
+		~Timer()
+		{
+			m_metrics.record(m_stage, tick_ns() - m_start, m_items);
+		}
+	};
+
+private:
+	typedef struct thread_stats {
+		Histogram latency[STAGES];
+		uint64_t items[STAGES];
+		char padding[64]; // keep the threads on separate cache lines
+	} thread_stats_t;
+
+	std::vector<thread_stats_t> m_threads;
+	std::mutex m_overflow;
+	uint64_t m_start;
+
+	static const char *
+	stage_name(int stage)
+	{
+		static const char *names[STAGES] = {
+			"parse", "transform", "build", "search", "score", "train", "output"
+		};
+		return names[stage];
+	}
+
+	static inline void
+	add(thread_stats_t &stats, stage_t stage, uint64_t ns, uint64_t items)
+	{
+		stats.latency[stage].record(ns);
+		stats.items[stage] += items;
+	}
+
+public:
+	Metrics() : m_threads(thread_count() + 1), m_start(tick_ns())
+	{
+		for (auto t = m_threads.begin(); t != m_threads.end(); ++t) {
+			std::memset(t->items, 0, sizeof(t->items));
+		}
+	}
+
+	inline void
+	record(stage_t stage, uint64_t ns, uint64_t items = 1)
+	{
+		size_t id = (size_t)ThreadSlot::id();
+		if (id + 1 < m_threads.size()) {
+			add(m_threads[id], stage, ns, items);
+		} else {
+			// more threads than at construction
+			std::lock_guard<std::mutex> guard(m_overflow);
+			add(m_threads.back(), stage, ns, items);
+		}
+	}
+
+	// per stage: calls, items, total time of all threads,
+	// per call latency percentiles and items per second of stage time.
+	// docs/s is documents per second of wall time since construction.
+	void
+	summary(FILE *fp, const char *name, uint64_t documents) const
+	{
+		double wall = (tick_ns() - m_start) * 1.0e-9;
+
+		std::fprintf(fp, "%s: metrics, %.3fs, %lu documents, %.1f docs/s\n",
+					 name, wall, (unsigned long)documents,
+					 wall > 0.0 ? documents / wall : 0.0);
+		std::fprintf(fp, "%-10s %10s %12s %12s %10s %10s %10s %10s %12s\n",
+					 "stage", "calls", "items", "total(ms)",
+					 "p50(us)", "p90(us)", "p99(us)", "max(us)", "items/s");
+		for (int s = 0; s < STAGES; ++s) {
+			Histogram latency;
+			uint64_t items = 0;
+			double total;
+
+			for (auto t = m_threads.begin(); t != m_threads.end(); ++t) {
+				latency.merge(t->latency[s]);
+				items += t->items[s];
+			}
+			if (latency.count() == 0) {
+				continue;
+			}
+			total = latency.sum() * 1.0e-9;
+			std::fprintf(fp, "%-10s %10lu %12lu %12.1f %10.1f %10.1f %10.1f %10.1f %12.1f\n",
+						 stage_name(s),
+						 (unsigned long)latency.count(),
+						 (unsigned long)items,
+						 total * 1.0e3,
+						 latency.percentile(0.50) * 1.0e-3,
+						 latency.percentile(0.90) * 1.0e-3,
+						 latency.percentile(0.99) * 1.0e-3,
+						 latency.max() * 1.0e-3,
+						 total > 0.0 ? items / total : 0.0);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef MULTI_CLASS_TRAINER_HPP
+#define MULTI_CLASS_TRAINER_HPP
+#include "util.hpp"
+#include "binary_classifier.hpp"
+#include "classifier_storage.hpp"
+#include "tick.hpp"
+#include <cstdio>
+#include <random>
+
+// Document-major SGD for the binary classifiers of all classes.
+//
+// BinaryClassifier::train reads the examples of one class at a time, so a
+// document is read once for each of its (up to K_TRAIN) candidate classes,
+// in separate passes. Here the classes are grouped into blocks of classes
+// that share documents, and each epoch of a block streams over its
+// documents once and updates all the candidate classes of a document
+// while the document is in cache. The blocks are trained in parallel, so
+// the weights of a class are only touched by one thread.
+//
+// An example is weighted so that the expected update is the same as
+// the sampling of BinaryClassifier::train (positives with probability p).
+class MultiClassTrainer
+{
+private:
+	typedef struct klass {
+		int target;
+		std::vector<int> ids; // sorted term ids, the local index is the position
+		std::vector<float> w;
+		float bias;
+		float weight[2];      // example weight of nega, posi
+		size_t iterations;
+	} class_t;
+	
+	// a (document, class) example, the local ids of the document terms
+	// are local_ids[offset .. offset + data[doc].size())
+	typedef struct example {
+		int doc;
+		int klass;            // index in the block
+		int y;
+		size_t offset;
+	} example_t;
+	
+	typedef struct block {
+		std::vector<int> targets;
+		size_t nnz;
+	} block_t;
+	
+	static bool
+	example_less(const example_t &a, const example_t &b)
+	{
+		return a.doc < b.doc || (a.doc == b.doc && a.klass < b.klass);
+	}
+	static bool
+	block_greater(const block_t &a, const block_t &b)
+	{
+		return a.nnz > b.nnz;
+	}
+	
+	// classes in the order they are first seen in the documents, so
+	// the classes of a block share the documents
+	static void
+	build_blocks(std::vector<block_t> &blocks,
+				 const std::vector<int> &targets,
+				 const std::vector<fv_t> &data,
+				 const category_index_t &dataset,
+				 size_t block_nnz)
+	{
+		std::vector<std::vector<int> > doc_targets(data.size());
+		std::vector<size_t> class_nnz;
+		std::vector<char> seen(targets.size(), 0);
+		std::vector<int> order;
+		
+		class_nnz.assign(targets.size(), 0);
+		for (size_t i = 0; i < targets.size(); ++i) {
+			auto docs = dataset.find(targets[i]);
+			if (docs == dataset.end()) {
+				continue;
+			}
+			for (auto doc = docs->second.begin(); doc != docs->second.end(); ++doc) {
+				doc_targets[*doc].push_back((int)i);
+				class_nnz[i] += data[*doc].size();
+			}
+		}
+		for (auto doc = doc_targets.begin(); doc != doc_targets.end(); ++doc) {
+			for (auto i = doc->begin(); i != doc->end(); ++i) {
+				if (!seen[*i]) {
+					seen[*i] = 1;
+					order.push_back(*i);
+				}
+			}
+		}
+		// classes without documents
+		for (size_t i = 0; i < targets.size(); ++i) {
+			if (!seen[i]) {
+				order.push_back((int)i);
+			}
+		}
+		
+		blocks.clear();
+		for (auto i = order.begin(); i != order.end(); ++i) {
+			if (blocks.empty() || blocks.back().nnz + class_nnz[*i] > block_nnz) {
+				blocks.push_back(block_t());
+				blocks.back().nnz = 0;
+			}
+			blocks.back().targets.push_back(targets[*i]);
+			blocks.back().nnz += class_nnz[*i];
+		}
+		// the largest blocks first
+		std::stable_sort(blocks.begin(), blocks.end(), block_greater);
+	}
+	
+	static void
+	train_block(ClassifierStorage &classifiers,
+				const block_t &block,
+				const std::vector<fv_t> &data,
+				const std::vector<label_t> &labels,
+				const category_index_t &dataset,
+				float eta, float p, size_t iteration)
+	{
+		std::vector<class_t> classes(block.targets.size());
+		std::vector<example_t> examples;
+		std::vector<int> local_ids;
+		std::vector<size_t> groups;
+		std::vector<size_t> order;
+		std::mt19937 rng;
+		
+		for (size_t k = 0; k < classes.size(); ++k) {
+			class_t &c = classes[k];
+			auto docs = dataset.find(block.targets[k]);
+			size_t posi = 0, nega = 0;
+			
+			c.target = block.targets[k];
+			c.bias = 0.0f;
+			c.iterations = 0;
+			if (docs != dataset.end()) {
+				for (auto doc = docs->second.begin(); doc != docs->second.end(); ++doc) {
+					if (labels[*doc].find(c.target) != labels[*doc].end()) {
+						posi += 1;
+					} else {
+						nega += 1;
+					}
+				}
+			}
+			if (posi == 0) {
+				c.bias = -1.0f;
+				continue;
+			} else if (nega == 0) {
+				c.bias = 1.0f;
+				continue;
+			}
+			c.weight[0] = (1.0f - p) * (posi + nega) / nega;
+			c.weight[1] = p * (posi + nega) / posi;
+			c.iterations = iteration;
+			for (auto doc = docs->second.begin(); doc != docs->second.end(); ++doc) {
+				for (auto x = data[*doc].begin(); x != data[*doc].end(); ++x) {
+					c.ids.push_back(x->first);
+				}
+			}
+			std::sort(c.ids.begin(), c.ids.end());
+			c.ids.erase(std::unique(c.ids.begin(), c.ids.end()), c.ids.end());
+			c.w.assign(c.ids.size(), 0.0f);
+			
+			for (auto doc = docs->second.begin(); doc != docs->second.end(); ++doc) {
+				example_t e;
+				auto id = c.ids.begin();
+				
+				e.doc = *doc;
+				e.klass = (int)k;
+				e.y = labels[*doc].find(c.target) != labels[*doc].end() ? 1 : 0;
+				e.offset = local_ids.size();
+				for (auto x = data[*doc].begin(); x != data[*doc].end(); ++x) {
+					// terms are sorted, so the search continues from the last one
+					id = std::lower_bound(id, c.ids.end(), x->first);
+					local_ids.push_back((int)(id - c.ids.begin()));
+				}
+				examples.push_back(e);
+			}
+		}
+		
+		// the examples of a document are adjacent,
+		// group i is examples[groups[i] .. groups[i + 1])
+		std::sort(examples.begin(), examples.end(), example_less);
+		for (size_t i = 0; i < examples.size(); ++i) {
+			if (i == 0 || examples[i].doc != examples[i - 1].doc) {
+				groups.push_back(i);
+			}
+		}
+		groups.push_back(examples.size());
+		for (size_t i = 0; i + 1 < groups.size(); ++i) {
+			order.push_back(i);
+		}
+		
+		for (size_t i = 0; i < iteration; ++i) {
+			float learning_rate = eta / (1.0f + (float)i / iteration);
+			
+			std::shuffle(order.begin(), order.end(), rng);
+			for (auto g = order.begin(); g != order.end(); ++g) {
+				const fv_t &fv = data[examples[groups[*g]].doc];
+				const size_t n = fv.size();
+				
+				for (size_t j = groups[*g]; j < groups[*g + 1]; ++j) {
+					const example_t &e = examples[j];
+					const int *local = local_ids.data() + e.offset;
+					class_t &c = classes[e.klass];
+					float *w = c.w.data();
+					float dot = c.bias;
+					float grad;
+					
+					for (size_t t = 0; t < n; ++t) {
+						dot += fv[t].second * w[local[t]];
+					}
+					grad = learning_rate * c.weight[e.y] * (fast_sigmoid(dot) - (float)e.y);
+					for (size_t t = 0; t < n; ++t) {
+						w[local[t]] -= grad * fv[t].second;
+					}
+					c.bias -= grad;
+				}
+			}
+		}
+		
+		for (auto c = classes.begin(); c != classes.end(); ++c) {
+			BinaryClassifier model;
+			model.set(c->ids, c->w, c->bias, c->iterations);
+			classifiers.set(c->target, model);
+		}
+	}
+
+public:
+	MultiClassTrainer(){}
+	
+	// trains the classifiers of targets on their documents in dataset.
+	// block_nnz limits the example terms of a block, a block takes
+	// about 4 bytes per term plus the weights of its classes.
+	void
+	train(ClassifierStorage &classifiers,
+		  const std::vector<int> &targets,
+		  const std::vector<fv_t> &data,
+		  const std::vector<label_t> &labels,
+		  const category_index_t &dataset,
+		  float eta, float p, size_t iteration,
+		  size_t block_nnz)
+	{
+		std::vector<block_t> blocks;
+		long t = tick();
+		
+		build_blocks(blocks, targets, data, dataset, block_nnz);
+		printf("build blocks %ld %ldms\n", blocks.size(), tick() - t);
+		t = tick();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+		for (int i = 0; i < (int)blocks.size(); ++i) {
+			if (i % 100 == 0) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+				{
+					printf("- train block %d/%ld %ldms\n",
+						   i, blocks.size(), tick() - t);
+					t = tick();
+				}
+			}
+			train_block(classifiers, blocks[i], data, labels, dataset,
+						eta, p, iteration);
+		}
+	}
+};
+
+#endif
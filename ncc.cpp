@@ -68,23 +68,30 @@ main(void)
 	tfidf.transform(data);
 	tfidf.transform(test_data);
 	centroid_classifier.train(category_index, data);
+	centroid_classifier.set_maxscore(NCC_MAXSCORE != 0);
 	printf("build index %ldms\n", tick() -t );
 	
 	t = tick();
 #ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 1)	
+#pragma omp parallel
 #endif
-	for (int i = 0; i < (int)test_data.size(); ++i) {
-		std::vector<int> topn_labels;
-		centroid_classifier.predict(topn_labels, K, test_data[i]);
+	{
+		InvertedIndex::SearchContext context;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+		for (int i = 0; i < (int)test_data.size(); ++i) {
+			std::vector<int> topn_labels;
+			centroid_classifier.predict(context, topn_labels, K, test_data[i]);
 #ifdef _OPENMP
 #pragma omp critical
 #endif
-		{
-			submission.push_back(std::make_pair(i, topn_labels));
-			if (i % 1000 == 0) {
-				printf("--- predict %d/%ld %ldms\n", i, test_data.size(), tick() -t);
-				t = tick();
+			{
+				submission.push_back(std::make_pair(i, topn_labels));
+				if (i % 1000 == 0) {
+					printf("--- predict %d/%ld %ldms\n", i, test_data.size(), tick() -t);
+					t = tick();
+				}
 			}
 		}
 	}
@@ -1,78 +1,106 @@
 #ifndef NCC_CACHE_HPP
 #define NCC_CACHE_HPP
 #include <vector>
-#include <map>
 #include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include "util.hpp"
+#include "mapped_file.hpp"
 
 // Cache for Nearest Centroid Classifier Results
+//
+// The results of document i are the row ids[i * k .. i * k + counts[i]),
+// counts[i] is -1 when there are no results. The query doc ids are dense
+// (0 .. docs - 1) and a result has at most k labels, so the rows have a
+// fixed stride. load() and load_rows() check that no count is above k.
+//
+// set() writes the row of its document only, so threads may call it for
+// different documents without locking. It needs a cache allocated by
+// resize(); a cache read by load() is mapped read-only and set() fails.
+//
+// Cache file written by save() and mapped by load():
+//
+// header  magic "LSHTCNCR" (the centroid file is "LSHTCNCC")
+// counts  int32_t[rows]
+// ids     int32_t[rows * k]
+//
+// save(file, begin, end) writes the rows of documents begin .. end - 1
+// (first = begin), load_rows() reads such a file into an allocated cache.
+// Files of the old format (per-document records) are still read.
 class NCCCache
 {
-private:
-	std::map<int, std::vector<int> > m_cache;
-	
 public:
-	NCCCache(){}
-	
-	void
-	set(unsigned int query_doc_id,
-		const std::vector<int> &results)
+	static const uint32_t VERSION = 2;
+
+	typedef struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t first;
+		uint64_t rows;
+		uint64_t k;
+		uint64_t counts;
+		uint64_t ids;
+	} header_t;
+
+private:
+	MappedFile m_file;
+	MappedArray<int32_t> m_counts;
+	MappedArray<int32_t> m_ids;
+	std::vector<int32_t> m_count_buffer;
+	std::vector<int32_t> m_id_buffer;
+	size_t m_k;
+
+	static void
+	set_magic(char *magic)
 	{
-#ifdef _OPENMP
-#pragma omp critical (ncc_cache)
-#endif
-		{
-			m_cache.insert(std::make_pair(query_doc_id, results));
-		}
+		std::memcpy(magic, "LSHTCNCR", 8);
 	}
-	
-	bool
-	get(unsigned int query_doc_id, std::vector<int> &results) const
+
+	// the sections of a file of size bytes are within it and every count
+	// fits its row, since get() reads counts[i] ids of the row
+	static bool
+	sections_valid(const char *data, size_t size)
 	{
-		bool ret = false;
-#ifdef _OPENMP
-#pragma omp critical (ncc_cache)
-#endif
+		const header_t *header = (const header_t *)data;
+		const int32_t *counts = (const int32_t *)(data + header->counts);
+
+		if (header->k != 0 && header->rows > ~(uint64_t)0 / header->k) {
+			return false;
+		}
+		if (header->counts < sizeof(header_t)
+			|| !MappedFile::section_fits(header->counts, header->rows, sizeof(int32_t), header->ids)
+			|| !MappedFile::section_fits(header->ids, header->rows * header->k, sizeof(int32_t), size))
 		{
-			auto cache = m_cache.find(query_doc_id);
-			if (cache != m_cache.end()) {
-				results = cache->second;
-				ret = true;
+			return false;
+		}
+		for (uint64_t i = 0; i < header->rows; ++i) {
+			if (counts[i] > 0 && (uint64_t)counts[i] > header->k) {
+				return false;
 			}
 		}
-		return ret;
+		return true;
 	}
 
-	bool
-	save(const char *file) const
+	void
+	use_buffers(void)
 	{
-		FILE *fp = std::fopen(file, "wb");
-		if (fp == 0) {
-			return false;
-		}
-		size_t size = m_cache.size();
-		std::fwrite(&size, sizeof(size), 1, fp);
-		for (auto cache = m_cache.begin(); cache != m_cache.end(); ++cache) {
-			int query_doc_id = cache->first;
-			size = cache->second.size();
-			std::fwrite(&query_doc_id, sizeof(query_doc_id), 1, fp);
-			std::fwrite(&size, sizeof(size), 1, fp);
-			std::fwrite(cache->second.data(), sizeof(int), size, fp);
-		}
-		fclose(fp);
-		
-		return true;
+		m_counts.set(m_count_buffer);
+		m_ids.set(m_id_buffer);
 	}
-	
+
+	// old format: per-document records
 	bool
-	load(const char *file)
+	load_records(const char *file)
 	{
+		std::vector<std::pair<int, std::vector<int> > > records;
 		FILE *fp = std::fopen(file, "rb");
-		
+		size_t docs = 0, k = 0;
+
 		if (fp == 0) {
 			return false;
 		}
-		m_cache.clear();
 		size_t cache_num = 0;
 		size_t ret = std::fread(&cache_num, sizeof(cache_num), 1, fp);
 		if (ret != 1) {
@@ -83,9 +111,8 @@ public:
 		for (size_t i = 0; i < cache_num; ++i) {
 			int query_doc_id;
 			size_t vec_size = 0;
-			std::vector<int> results;
 			ret = fread(&query_doc_id, sizeof(query_doc_id), 1, fp);
-			if (ret != 1) {
+			if (ret != 1 || query_doc_id < 0) {
 				std::fprintf(stderr, "NCCCache: %s: invalid format 2\n", file);
 				fclose(fp);
 				return false;
@@ -96,20 +123,213 @@ public:
 				fclose(fp);
 				return false;
 			}
-			int buffer[vec_size];
-			ret = fread(&buffer[0], sizeof(int), vec_size, fp);
+			std::vector<int> results(vec_size);
+			ret = fread(results.data(), sizeof(int), vec_size, fp);
 			if (ret != vec_size) {
 				std::fprintf(stderr, "NCCCache: %s: invalid format 4\n", file);
 				fclose(fp);
 				return false;
 			}
-			std::copy(buffer, buffer + vec_size, std::back_inserter(results));
-			m_cache.insert(std::make_pair(query_doc_id, results));
+			docs = std::max(docs, (size_t)query_doc_id + 1);
+			k = std::max(k, vec_size);
+			records.push_back(std::make_pair(query_doc_id, results));
 		}
 		fclose(fp);
+
+		resize(docs, k);
+		for (auto record = records.begin(); record != records.end(); ++record) {
+			set(record->first, record->second);
+		}
+
+		return true;
+	}
+
+public:
+	NCCCache() : m_k(0) {}
+
+	// allocates an empty cache of docs documents with at most k results
+	void
+	resize(size_t docs, size_t k)
+	{
+		m_file.close();
+		m_k = k;
+		m_count_buffer.assign(docs, -1);
+		m_id_buffer.assign(docs * k, 0);
+		use_buffers();
+	}
+
+	// may be called from many threads for different documents, does not lock.
+	// results after the first k are dropped. returns false when the document
+	// is out of range or the cache is a mapped file.
+	bool
+	set(unsigned int query_doc_id,
+		const std::vector<int> &results)
+	{
+		if (m_file.is_open() || query_doc_id >= m_count_buffer.size()) {
+			return false;
+		}
+		size_t n = std::min(results.size(), m_k);
+		std::copy(results.begin(), results.begin() + n,
+				  m_id_buffer.begin() + (size_t)query_doc_id * m_k);
+		m_count_buffer[query_doc_id] = (int32_t)n;
 		
 		return true;
 	}
+
+	bool
+	get(unsigned int query_doc_id, std::vector<int> &results) const
+	{
+		if (query_doc_id >= m_counts.size() || m_counts[query_doc_id] < 0) {
+			return false;
+		}
+		const int32_t *row = m_ids.data() + (size_t)query_doc_id * m_k;
+		results.assign(row, row + m_counts[query_doc_id]);
+		return true;
+	}
+
+	size_t
+	size(void) const
+	{
+		return m_counts.size();
+	}
+	// the rows, or the mapped cache file
+	size_t
+	memory_usage(void) const
+	{
+		return ::memory_usage(m_count_buffer)
+			+ ::memory_usage(m_id_buffer)
+			+ m_file.size();
+	}
+
+	bool
+	save(const char *file) const
+	{
+		return save(file, 0, size());
+	}
+
+	// saves the rows of documents begin .. end - 1
+	bool
+	save(const char *file, size_t begin, size_t end) const
+	{
+		header_t header;
+		bool ok = true;
+
+		end = std::min(end, size());
+		begin = std::min(begin, end);
+		std::memset(&header, 0, sizeof(header));
+		set_magic(header.magic);
+		header.version = VERSION;
+		header.first = begin;
+		header.rows = end - begin;
+		header.k = m_k;
+		header.counts = MappedFile::align8(sizeof(header));
+		header.ids = MappedFile::align8(header.counts + header.rows * sizeof(int32_t));
+
+		FILE *fp = std::fopen(file, "wb");
+		if (fp == 0) {
+			return false;
+		}
+		ok &= std::fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok &= MappedFile::write_padding(fp, sizeof(header));
+		ok &= std::fwrite(m_counts.data() + begin, sizeof(int32_t), header.rows, fp) == header.rows;
+		ok &= MappedFile::write_padding(fp, header.counts + header.rows * sizeof(int32_t));
+		ok &= std::fwrite(m_ids.data() + begin * m_k, sizeof(int32_t), header.rows * m_k, fp) == header.rows * m_k;
+		ok &= std::fclose(fp) == 0;
+
+		return ok;
+	}
+
+	// maps a cache file written by save(file)
+	bool
+	load(const char *file)
+	{
+		const header_t *header;
+		char magic[8];
+
+		resize(0, 0);
+		if (!m_file.open(file)) {
+			return false;
+		}
+		set_magic(magic);
+		if (m_file.size() >= sizeof(header_t)
+			&& std::memcmp(m_file.data(), "LSHTC", 5) == 0
+			&& std::memcmp(m_file.data(), magic, sizeof(magic)) != 0)
+		{
+			// another file of this project, e.g. the centroid file
+			std::fprintf(stderr, "NCCCache: %s: not a cache file\n", file);
+			resize(0, 0);
+			return false;
+		}
+		if (m_file.size() < sizeof(header_t)
+			|| std::memcmp(m_file.data(), magic, sizeof(magic)) != 0)
+		{
+			m_file.close();
+			return load_records(file);
+		}
+		header = (const header_t *)m_file.data();
+		if (header->version != VERSION) {
+			std::fprintf(stderr, "NCCCache: %s: unsupported version %u\n",
+						 file, header->version);
+			resize(0, 0);
+			return false;
+		}
+		if (header->first != 0 || !sections_valid(m_file.data(), m_file.size())) {
+			std::fprintf(stderr, "NCCCache: %s: invalid format 5\n", file);
+			resize(0, 0);
+			return false;
+		}
+		m_k = header->k;
+		m_counts.set((const int32_t *)(m_file.data() + header->counts), header->rows);
+		m_ids.set((const int32_t *)(m_file.data() + header->ids), header->rows * m_k);
+
+		return true;
+	}
+
+	// reads the rows of a file written by save(file, begin, end)
+	// into a cache allocated by resize(). the file must hold the rows
+	// first .. first + rows - 1.
+	bool
+	load_rows(const char *file, size_t first, size_t rows)
+	{
+		MappedFile mapped;
+		const header_t *header;
+		char magic[8];
+
+		if (!mapped.open(file)) {
+			return false;
+		}
+		set_magic(magic);
+		if (mapped.size() < sizeof(header_t)
+			|| std::memcmp(mapped.data(), magic, sizeof(magic)) != 0)
+		{
+			std::fprintf(stderr, "NCCCache: %s: invalid format 1\n", file);
+			return false;
+		}
+		header = (const header_t *)mapped.data();
+		if (header->version == VERSION
+			&& (header->first != first || header->rows != rows))
+		{
+			std::fprintf(stderr, "NCCCache: %s: rows %lu..%lu, expected %lu..%lu\n",
+						 file, (unsigned long)header->first,
+						 (unsigned long)(header->first + header->rows),
+						 (unsigned long)first, (unsigned long)(first + rows));
+			return false;
+		}
+		if (header->version != VERSION
+			|| header->k != m_k
+			|| header->first + header->rows > m_count_buffer.size()
+			|| !sections_valid(mapped.data(), mapped.size()))
+		{
+			std::fprintf(stderr, "NCCCache: %s: invalid format 5\n", file);
+			return false;
+		}
+		std::memcpy(m_count_buffer.data() + header->first,
+					mapped.data() + header->counts, header->rows * sizeof(int32_t));
+		std::memcpy(m_id_buffer.data() + header->first * m_k,
+					mapped.data() + header->ids, header->rows * m_k * sizeof(int32_t));
+
+		return true;
+	}
 };
 
 #endif
@@ -2,31 +2,104 @@
 #define NEAREST_CENTROID_CLASSIFIER_HPP
 #include "util.hpp"
 #include "inverted_index.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
 
+// Centroid file written by save() and mapped by load().
+// The index is stored already built, so load() does not parse or
+// rebuild anything. Files of the old format (per-term records) are
+// still read, and the index is rebuilt for them.
+// load() checks that the sections are within the file and the row
+// offsets are nondecreasing and end at nnz. The loaded index has no data
+// vectors, so InvertedIndex::fast_knn() refuses it.
+//
+// header
+// labels        int32_t[centroids]
+// row_offsets   uint64_t[centroids + 1]
+// term_ids      int32_t[nnz]
+// values        float[nnz]
+// index         InvertedIndex::write() section
+//
+// quantize() replaces the index by a compressed one (bit-packed ids and
+// 8-bit values, see CompressedPostings), which save() stores as is.
+// A quantized file has no float rows (nnz = 0, the row offsets are 0),
+// the search only reads the index.
 class NearestCentroidClassifier
 {
+public:
+	static const uint32_t VERSION = 1;
+	
+	typedef struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t centroids;
+		uint64_t nnz;
+		uint64_t labels;
+		uint64_t row_offsets;
+		uint64_t term_ids;
+		uint64_t values;
+		uint64_t index;
+		uint64_t index_size;
+	} header_t;
+	
 private:
+	// trained centroids, or the centroid rows of the mapped file
 	std::vector<fv_t> m_centroids;
+	MappedFile m_file;
+	MappedArray<uint64_t> m_row_offsets;
+	MappedArray<int32_t> m_term_ids;
+	MappedArray<float> m_values;
 	std::vector<int> m_centroid_labels;
 	InvertedIndex m_inverted_index;
+	bool m_maxscore;
+	
+	static void
+	set_magic(char *magic)
+	{
+		std::memcpy(magic, "LSHTCNCC", 8);
+	}
 	
+	// sum of the rows of data in indexes. work is zero and is left zero,
+	// stamp[id] == generation marks the words seen in this call
 	static void
 	vector_sum(fv_t &sum,
 			   const std::vector<int> &indexes,
-			   const std::vector<fv_t> &data)
+			   const std::vector<fv_t> &data,
+			   std::vector<float> &work,
+			   std::vector<uint32_t> &stamp,
+			   uint32_t &generation)
 	{
-		sum.clear();
+		std::vector<int> words;
+		
+		if (++generation == 0) {
+			std::fill(stamp.begin(), stamp.end(), 0);
+			generation = 1;
+		}
 		for (auto i = indexes.begin(); i != indexes.end(); ++i) {
 			const fv_t &x = data[*i];
 			for (auto word = x.begin(); word != x.end(); ++word) {
-				auto s = sum.find(word->first);
-				if (s != sum.end()) {
-					s->second += word->second;
-				} else {
-					sum.insert(std::make_pair(word->first, word->second));
+				if (word->first >= (int)work.size()) {
+					work.resize(word->first + 1, 0.0f);
+					stamp.resize(word->first + 1, 0);
+				}
+				if (stamp[word->first] != generation) {
+					stamp[word->first] = generation;
+					words.push_back(word->first);
 				}
+				work[word->first] += word->second;
 			}
 		}
+		std::sort(words.begin(), words.end());
+		sum.clear();
+		sum.reserve(words.size());
+		for (auto i = words.begin(); i != words.end(); ++i) {
+			sum.push_back(std::make_pair(*i, work[*i]));
+			work[*i] = 0.0f;
+		}
 	}
 	
 	static void
@@ -45,15 +118,28 @@ private:
 	}
 	
 public:
-	NearestCentroidClassifier(){}
+	NearestCentroidClassifier() : m_maxscore(false) {}
+	
+	// use InvertedIndex::maxscore_knn (same results, pruned search)
+	void
+	set_maxscore(bool maxscore)
+	{
+		m_maxscore = maxscore;
+	}
 	
 	void
 	train(const category_index_t &category_index,
 		  const std::vector<fv_t> &data)
 	{
+		std::vector<float> work;
+		std::vector<uint32_t> stamp;
+		uint32_t generation = 0;
+		TraceSpan span("NearestCentroidClassifier::train", category_index.size());
+		
+		clear();
 		for (auto l = category_index.begin(); l != category_index.end(); ++l) {
 			fv_t centroid;
-			vector_sum(centroid, l->second, data);
+			vector_sum(centroid, l->second, data, work, stamp, generation);
 			vector_normalize_l2(centroid);
 			m_centroids.push_back(centroid);
 			m_centroid_labels.push_back(l->first);
@@ -62,54 +148,270 @@ public:
 	}
 	
 	inline void
-	predict(std::vector<int> &results,
+	predict(InvertedIndex::SearchContext &context,
+			std::vector<int> &results,
 			size_t k,
 			const fv_t &query) const
 	{
 		InvertedIndex::result_t knn;
 		
-		m_inverted_index.knn(knn, k, query);
+		if (m_maxscore) {
+			m_inverted_index.maxscore_knn(context, knn, k, query);
+		} else {
+			m_inverted_index.knn(context, knn, k, query);
+		}
 		results.clear();
 		for (auto i = knn.begin(); i != knn.end(); ++i) {
 			results.push_back(m_centroid_labels[i->id]);
 		}
 	}
+	inline void
+	predict(std::vector<int> &results,
+			size_t k,
+			const fv_t &query) const
+	{
+		InvertedIndex::SearchContext context;
+		predict(context, results, k, query);
+	}
+	
+	// predict() for n queries at once (see InvertedIndex::knn_batch)
+	void
+	predict_batch(InvertedIndex::SearchContext &context,
+				  std::vector<std::vector<int> > &results,
+				  size_t k,
+				  const fv_t *queries,
+				  size_t n) const
+	{
+		std::vector<InvertedIndex::result_t> knn;
+		
+		if (m_maxscore) {
+			results.resize(n);
+			for (size_t i = 0; i < n; ++i) {
+				predict(context, results[i], k, queries[i]);
+			}
+			return;
+		}
+		m_inverted_index.knn_batch(context, knn, k, queries, n);
+		results.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			results[i].clear();
+			for (auto j = knn[i].begin(); j != knn[i].end(); ++j) {
+				results[i].push_back(m_centroid_labels[j->id]);
+			}
+		}
+	}
 
+	// compresses the index, the search results may change slightly
+	// by the quantization of the values
+	void
+	quantize(void)
+	{
+		std::vector<fv_t> rows;
+		
+		if (m_inverted_index.compressed()) {
+			return;
+		}
+		if (!m_centroids.empty()) {
+			m_inverted_index.build(&m_centroids, true);
+			return;
+		}
+		rows.resize(m_centroid_labels.size());
+		for (size_t i = 0; i < rows.size(); ++i) {
+			for (uint64_t j = m_row_offsets[i]; j < m_row_offsets[i + 1]; ++j) {
+				rows[i].push_back(std::make_pair((int)m_term_ids[j], m_values[j]));
+			}
+		}
+		m_inverted_index.build(&rows, true);
+		m_inverted_index.release_data();
+	}
+	bool
+	quantized(void) const
+	{
+		return m_inverted_index.compressed();
+	}
+	
 	size_t
 	size(void) const
 	{
-		return m_centroids.size();
+		return m_centroid_labels.size();
+	}
+	// fingerprint of the centroids and their labels (the labels only
+	// for a loaded quantized file, it has no rows)
+	uint64_t
+	fingerprint(void) const
+	{
+		uint64_t h = fv_fingerprint(m_centroids.data(), m_centroids.size());
+		
+		for (size_t i = 0; m_centroids.empty() && i < m_centroid_labels.size(); ++i) {
+			h = fv_fingerprint_add(h, m_row_offsets[i + 1] - m_row_offsets[i]);
+			for (uint64_t j = m_row_offsets[i]; j < m_row_offsets[i + 1]; ++j) {
+				uint32_t bits;
+				std::memcpy(&bits, &m_values[j], sizeof(bits));
+				h = fv_fingerprint_add(h, ((uint64_t)(uint32_t)m_term_ids[j] << 32) | bits);
+			}
+		}
+		for (auto l = m_centroid_labels.begin(); l != m_centroid_labels.end(); ++l) {
+			h = fv_fingerprint_add(h, (uint64_t)(uint32_t)*l);
+		}
+		return h;
+	}
+	// centroids, labels and index, or the mapped centroid file
+	size_t
+	memory_usage(void) const
+	{
+		return ::memory_usage(m_centroids)
+			+ ::memory_usage(m_centroid_labels)
+			+ m_file.size()
+			+ m_inverted_index.memory_usage();
 	}
 
+	void
+	clear(void)
+	{
+		m_inverted_index.clear();
+		m_centroids.clear();
+		m_centroid_labels.clear();
+		m_row_offsets.set(0, 0);
+		m_term_ids.set(0, 0);
+		m_values.set(0, 0);
+		m_file.close();
+	}
+	
 	bool
 	save(const char *file) const
 	{
+		header_t header;
+		std::vector<uint64_t> row_offsets;
+		std::vector<int32_t> term_ids;
+		std::vector<float> values;
+		bool ok = true;
+		
+		if (m_inverted_index.compressed()) {
+			// the float rows are not needed by the compressed index
+			row_offsets.assign(m_centroid_labels.size() + 1, 0);
+		} else if (m_file.is_open()) {
+			row_offsets.assign(m_row_offsets.begin(), m_row_offsets.end());
+			term_ids.assign(m_term_ids.begin(), m_term_ids.end());
+			values.assign(m_values.begin(), m_values.end());
+		} else {
+			row_offsets.push_back(0);
+			for (auto centroid = m_centroids.begin();
+				 centroid != m_centroids.end(); ++centroid)
+			{
+				for (auto w = centroid->begin(); w != centroid->end(); ++w) {
+					term_ids.push_back(w->first);
+					values.push_back(w->second);
+				}
+				row_offsets.push_back(term_ids.size());
+			}
+		}
+		
+		std::memset(&header, 0, sizeof(header));
+		set_magic(header.magic);
+		header.version = VERSION;
+		header.centroids = m_centroid_labels.size();
+		header.nnz = term_ids.size();
+		header.labels = MappedFile::align8(sizeof(header));
+		header.row_offsets = MappedFile::align8(header.labels + m_centroid_labels.size() * sizeof(int32_t));
+		header.term_ids = MappedFile::align8(header.row_offsets + row_offsets.size() * sizeof(uint64_t));
+		header.values = MappedFile::align8(header.term_ids + term_ids.size() * sizeof(int32_t));
+		header.index = MappedFile::align8(header.values + values.size() * sizeof(float));
+		
 		FILE *fp = std::fopen(file, "wb");
 		if (fp == 0) {
 			return false;
 		}
-		size_t size = m_centroids.size();
-		std::fwrite(&size, sizeof(size), 1, fp);
-		for (auto centroid = m_centroids.begin();
-			 centroid != m_centroids.end(); ++centroid)
+		// the index size is known after writing it
+		ok &= std::fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok &= MappedFile::write_padding(fp, sizeof(header));
+		ok &= std::fwrite(m_centroid_labels.data(), sizeof(int32_t), m_centroid_labels.size(), fp) == m_centroid_labels.size();
+		ok &= MappedFile::write_padding(fp, header.labels + m_centroid_labels.size() * sizeof(int32_t));
+		ok &= std::fwrite(row_offsets.data(), sizeof(uint64_t), row_offsets.size(), fp) == row_offsets.size();
+		ok &= std::fwrite(term_ids.data(), sizeof(int32_t), term_ids.size(), fp) == term_ids.size();
+		ok &= MappedFile::write_padding(fp, header.term_ids + term_ids.size() * sizeof(int32_t));
+		ok &= std::fwrite(values.data(), sizeof(float), values.size(), fp) == values.size();
+		ok &= MappedFile::write_padding(fp, header.values + values.size() * sizeof(float));
+		ok &= m_inverted_index.write(fp);
+		if (ok) {
+			header.index_size = (uint64_t)std::ftell(fp) - header.index;
+			ok &= std::fseek(fp, 0, SEEK_SET) == 0;
+			ok &= std::fwrite(&header, sizeof(header), 1, fp) == 1;
+		}
+		ok &= std::fclose(fp) == 0;
+		
+		return ok;
+	}
+	
+	bool
+	load(const char *file)
+	{
+		const header_t *header;
+		char magic[8];
+		
+		clear();
+		if (!m_file.open(file)) {
+			return false;
+		}
+		set_magic(magic);
+		if (m_file.size() >= sizeof(header_t)
+			&& std::memcmp(m_file.data(), "LSHTC", 5) == 0
+			&& std::memcmp(m_file.data(), magic, sizeof(magic)) != 0)
 		{
-			size = centroid->size();
-			std::fwrite(&size, sizeof(size), 1, fp);
-			for (auto w = centroid->begin(); w != centroid->end(); ++w) {
-				std::fwrite(&w->first, sizeof(w->first), 1, fp);
-				std::fwrite(&w->second, sizeof(w->second), 1, fp);
-			}
+			// another file of this project, e.g. the NCC cache
+			std::fprintf(stderr, "%s: not a centroid file\n", file);
+			clear();
+			return false;
 		}
-		size = m_centroid_labels.size();
-		std::fwrite(&size, sizeof(size), 1, fp);
-		std::fwrite(m_centroid_labels.data(), sizeof(int), size, fp);
-		fclose(fp);
+		if (m_file.size() < sizeof(header_t)
+			|| std::memcmp(m_file.data(), magic, sizeof(magic)) != 0)
+		{
+			m_file.close();
+			return load_records(file);
+		}
+		header = (const header_t *)m_file.data();
+		if (header->version != VERSION) {
+			std::fprintf(stderr, "%s: unsupported version %u\n", file, header->version);
+			clear();
+			return false;
+		}
+		// the sections are in file order and must not overlap, the
+		// index has one document per centroid
+		const header_t &h = *header;
+		if (h.centroids + 1 == 0
+			|| h.labels < sizeof(header_t)
+			|| !MappedFile::section_fits(h.labels, h.centroids, sizeof(int32_t), h.row_offsets)
+			|| !MappedFile::section_fits(h.row_offsets, h.centroids + 1, sizeof(uint64_t), h.term_ids)
+			|| !MappedFile::section_fits(h.term_ids, h.nnz, sizeof(int32_t), h.values)
+			|| !MappedFile::section_fits(h.values, h.nnz, sizeof(float), h.index)
+			|| !MappedFile::section_fits(h.index, h.index_size, 1, m_file.size())
+			|| h.index % 8 != 0
+			|| m_inverted_index.attach(m_file.data() + h.index, (size_t)h.index_size) == 0
+			|| m_inverted_index.docs() != h.centroids)
+		{
+			std::fprintf(stderr, "%s: invalid format 7\n", file);
+			clear();
+			return false;
+		}
+		m_row_offsets.set((const uint64_t *)(m_file.data() + h.row_offsets), h.centroids + 1);
+		m_term_ids.set((const int32_t *)(m_file.data() + h.term_ids), h.nnz);
+		m_values.set((const float *)(m_file.data() + h.values), h.nnz);
+		if (!MappedFile::offsets_valid(m_row_offsets.data(), h.centroids, h.nnz)
+			|| !MappedFile::ids_valid(m_term_ids.data(), h.nnz))
+		{
+			std::fprintf(stderr, "%s: invalid format 8\n", file);
+			clear();
+			return false;
+		}
+		m_centroid_labels.assign((const int32_t *)(m_file.data() + h.labels),
+								 (const int32_t *)(m_file.data() + h.labels) + h.centroids);
 		
 		return true;
 	}
-
+	
+private:
+	// old format: per-term records, the index is rebuilt
 	bool
-	load(const char *file)
+	load_records(const char *file)
 	{
 		FILE *fp = std::fopen(file, "rb");
 		
@@ -136,6 +438,7 @@ public:
 				fclose(fp);
 				return false;
 			}
+			centroid.reserve(word_num);
 			for (size_t j = 0; j < word_num; ++j) {
 				int word_id;
 				float word_weight;
@@ -151,7 +454,7 @@ public:
 					fclose(fp);
 					return false;
 				}
-				centroid.insert(std::make_pair(word_id, word_weight));
+				centroid.push_back(std::make_pair(word_id, word_weight));
 			}
 			m_centroids.push_back(centroid);
 		}
@@ -1,6 +1,8 @@
 #include "util.hpp"
 #include "reader.hpp"
-#include "tick.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "memory_report.hpp"
 #include "nearest_centroid_classifier.hpp"
 #include "tfidf_transformer.hpp"
 #include "classifier_storage.hpp"
@@ -9,25 +11,16 @@
 
 static void
 predict_labels(std::vector<int> &results,
+			   ClassifierStorage::ScoreContext &context,
 			   const fv_t &query,
 			   const std::vector<int> &search_results,
-			   ClassifierStorage &classifiers)
+			   const ClassifierStorage &classifiers)
 {
-	std::vector<int> candidate_labels;
-	std::vector<std::pair<double, int> > rank;
+	std::vector<std::pair<float, int> > rank;
 	
-	for (auto doc = search_results.begin(); doc != search_results.end(); ++doc) {
-		candidate_labels.push_back(*doc);
-	}
-	for (int i = 0; i < (int)candidate_labels.size(); ++i) {
-		const BinaryClassifier *classifier = classifiers.get(candidate_labels[i]);
-		if (classifier != 0) {
-			float value = classifier->predict(query);
-			rank.push_back(std::make_pair(value, candidate_labels[i]));
-		}
-	}
+	classifiers.predict(context, rank, search_results, query);
 	std::sort(rank.begin(), rank.end(),
-			  std::greater<std::pair<double, int> >());
+			  std::greater<std::pair<float, int> >());
 	for (auto i = rank.begin(); i != rank.end(); ++i) {
 		if (results.size() == 0 || i->first >= 0.0) {
 			results.push_back(i->second);
@@ -35,106 +28,199 @@ predict_labels(std::vector<int> &results,
 	}
 }
 
-bool
-read_data(std::vector<fv_t> &data,
-		  std::vector<label_t> &labels,
-		  std::vector<fv_t> &test_data)
+// documents of the streaming pipeline: read, then predicted, then written
+typedef struct chunk {
+	size_t first;                           // id of data[0]
+	std::vector<fv_t> data;
+	std::vector<label_t> labels;
+	std::vector<std::vector<int> > results; // results[i] of data[i]
+} chunk_t;
+
+static void
+clear_chunk(chunk_t &chunk, size_t first)
 {
-	DataReader reader;
-	DataReader test_reader;
-	std::vector<label_t> *dummy_labels = new std::vector<label_t>;
-	
-	if (!reader.open(TRAIN_DATA)) {
-		fprintf(stderr, "open failed: %s:\n", TRAIN_DATA);
-		return false;
-	}
-	if (!test_reader.open(TEST_DATA)) {
-		fprintf(stderr, "open failed: %s\n", TEST_DATA);
+	chunk.first = first;
+	chunk.data.clear();
+	chunk.labels.clear();
+	chunk.results.clear();
+}
+
+static bool
+read_chunk(DataReader &reader, chunk_t &chunk, size_t first)
+{
+	TraceSpan span("read chunk");
+	clear_chunk(chunk, first);
+	if (!reader.read_chunk(chunk.data, chunk.labels, PREDICT_CHUNK)) {
 		return false;
 	}
-	reader.read(data, labels);
-	test_reader.read(test_data, *dummy_labels);
-	
-	reader.close();
-	test_reader.close();
-	delete dummy_labels;
-
+	span.set_items(chunk.data.size());
+	chunk.results.resize(chunk.data.size());
 	return true;
 }
 
-void
-make_submission(const std::vector<std::pair<int, std::vector<int> > > &submission)
+// the results are in the order of the documents, whatever order
+// the threads finished them in
+static bool
+write_chunk(FILE *fp, const chunk_t &chunk)
 {
-	FILE *fp = fopen(SUBMISSION, "w");
-	fprintf(fp, "Id,Predicted\n");
-	for (auto i = submission.begin(); i != submission.end(); ++i) {
+	TraceSpan span("write chunk", chunk.results.size());
+	bool ok = true;
+	
+	for (size_t i = 0; i < chunk.results.size(); ++i) {
 		bool first = true;
-		fprintf(fp, "%d,", i->first + 1);
-		for (auto j = i->second.begin(); j != i->second.end(); ++j)	{
+		ok &= fprintf(fp, "%ld,", (long)(chunk.first + i + 1)) > 0;
+		for (auto j = chunk.results[i].begin(); j != chunk.results[i].end(); ++j)	{
 			if (first) {
 				first = false;
 			} else {
-				fprintf(fp, " ");
+				fputc(' ', fp);
 			}
-			fprintf(fp, "%d", *j);
+			ok &= fprintf(fp, "%d", *j) > 0;
 		}
-		fprintf(fp, "\n");
+		ok &= fputc('\n', fp) != EOF;
 	}
-	fclose(fp);
+	return ok;
 }
 
-int main(void)
+// The test file is processed in chunks of PREDICT_CHUNK documents.
+// While the threads predict a chunk, one thread writes the previous chunk
+// and reads the next one (then joins the others), so at most three chunks
+// are in memory and the I/O overlaps the search.
+int main(int argc, char **argv)
 {
-	std::vector<fv_t> test_data;
-	std::vector<label_t> test_labels;
 	TFIDFTransformer transformer;
 	NearestCentroidClassifier centroid;	
 	ClassifierStorage classifier_storage;
-	std::vector<std::pair<int, std::vector<int> > > submission;
-	long t = tick();
+	chunk_t chunks[3];
+	chunk_t *reading = &chunks[0];
+	chunk_t *working = &chunks[1];
+	chunk_t *writing = &chunks[2];
+	bool more;
+	bool ok = true;
+	Metrics metrics;
+	uint64_t t;
+	size_t documents = 0;
 	DataReader reader;
+	FILE *fp;
+	auto print_memory = [&](const char *phase) {
+		MemoryReport report;
+		size_t chunk_bytes = 0;
+		for (int i = 0; i < 3; ++i) {
+			chunk_bytes += memory_usage(chunks[i].data)
+				+ memory_usage(chunks[i].labels)
+				+ memory_usage(chunks[i].results);
+		}
+		report.add("idf", transformer.memory_usage());
+		report.add("centroids", centroid.memory_usage());
+		report.add("classifiers", classifier_storage.memory_usage());
+		report.add("chunks", chunk_bytes);
+		report.print(stdout, argv[0], phase);
+	};
 	
-	if (!classifier_storage.load(MODEL)) {
-		fprintf(stderr, "cant open classifier storage\n");
-		return -1;
+	if (TRACE) {
+		Trace::instance().open((std::string(argv[0]) + ".trace.json").c_str());
 	}
-	if (!reader.open(TEST_DATA)) {
-		fprintf(stderr, "open failed: %s\n", TEST_DATA);
-		return -1;
+	t = tick_ns();
+	{
+		TraceSpan span("load");
+		if (!classifier_storage.load(MODEL)) {
+			fprintf(stderr, "cant open classifier storage\n");
+			return -1;
+		}
+		classifier_storage.build_term_index();
+		if (!reader.open(TEST_DATA)) {
+			fprintf(stderr, "open failed: %s\n", TEST_DATA);
+			return -1;
+		}
+		transformer.load(WEIGHT);
+		centroid.load(CENTROID);
+		centroid.set_maxscore(NCC_MAXSCORE != 0);
 	}
-	reader.read(test_data, test_labels);
-	printf("read test: %ld, %ldms\n",
-		   test_data.size(), tick() - t);
-	t = tick();
+	metrics.record(Metrics::BUILD, tick_ns() - t, centroid.size());
+	print_memory("load");
 	
-	transformer.load(WEIGHT);
-	transformer.transform(test_data);
-	centroid.load(CENTROID);
+	fp = fopen(SUBMISSION, "w");
+	if (fp == 0) {
+		fprintf(stderr, "open failed: %s\n", SUBMISSION);
+		return -1;
+	}
+	fprintf(fp, "Id,Predicted\n");
 	
-	t = tick();
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 1)
-#endif
-	for (int id = 0; id < (int)test_data.size(); ++id) {
-		std::vector<int> topn_labels;
-		std::vector<int> results;
-		
-		centroid.predict(results, K_PREDICT, test_data[id]);
-		predict_labels(topn_labels, test_data[id], results, classifier_storage);
+	clear_chunk(*writing, 0);
+	t = tick_ns();
+	more = read_chunk(reader, *working, 0);
+	metrics.record(Metrics::PARSE, tick_ns() - t, working->data.size());
+	while (!working->data.empty() || !writing->data.empty()) {
+		size_t next = working->first + working->data.size();
 		
 #ifdef _OPENMP
-#pragma omp critical (submission)
+#pragma omp parallel
 #endif
 		{
-			submission.push_back(std::make_pair(id, topn_labels));
-			if (id % 10000 == 0) {
-				printf("--- predict %d/%ld %ldms\n", id, test_data.size(), tick() -t);
-				t = tick();
+			InvertedIndex::SearchContext context;
+			ClassifierStorage::ScoreContext score_context;
+			
+#ifdef _OPENMP
+#pragma omp single nowait
+#endif
+			{
+				if (!writing->data.empty()) {
+					Metrics::Timer timer(metrics, Metrics::OUTPUT, writing->data.size());
+					ok &= write_chunk(fp, *writing);
+				}
+				if (more) {
+					uint64_t start = tick_ns();
+					more = read_chunk(reader, *reading, next);
+					metrics.record(Metrics::PARSE, tick_ns() - start, reading->data.size());
+				} else {
+					clear_chunk(*reading, next);
+				}
+			}
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1) nowait
+#endif
+			for (int i = 0; i < (int)working->data.size(); i += InvertedIndex::BATCH_SIZE) {
+				int n = std::min((int)working->data.size() - i, (int)InvertedIndex::BATCH_SIZE);
+				std::vector<std::vector<int> > results;
+				TraceSpan span("predict batch", n);
+				
+				uint64_t start = tick_ns();
+				for (int j = 0; j < n; ++j) {
+					transformer.transform(working->data[i + j]);
+				}
+				metrics.record(Metrics::TRANSFORM, tick_ns() - start, n);
+				start = tick_ns();
+				centroid.predict_batch(context, results, K_PREDICT, &working->data[i], n);
+				metrics.record(Metrics::SEARCH, tick_ns() - start, n);
+				start = tick_ns();
+				for (int j = 0; j < n; ++j) {
+					predict_labels(working->results[i + j], score_context,
+								   working->data[i + j], results[j], classifier_storage);
+				}
+				metrics.record(Metrics::SCORE, tick_ns() - start, n);
+				size_t id = working->first + i;
+				if (id / 10000 != (id + n) / 10000) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+					{
+						printf("--- predict %ld\n", (long)id);
+					}
+				}
 			}
 		}
+		documents += working->data.size();
+		std::swap(writing, working);
+		std::swap(working, reading);
+	}
+	ok &= fclose(fp) == 0;
+	if (!ok) {
+		fprintf(stderr, "write failed: %s\n", SUBMISSION);
+		return -1;
 	}
-	std::sort(submission.begin(), submission.end());
-	make_submission(submission);
+	print_memory("predict");
+	metrics.summary(stdout, argv[0], documents);
+	Trace::instance().save();
 	
 	return 0;
 }
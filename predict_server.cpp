@@ -0,0 +1,473 @@
+#include "util.hpp"
+#include "reader.hpp"
+#include "tick.hpp"
+#include "nearest_centroid_classifier.hpp"
+#include "tfidf_transformer.hpp"
+#include "classifier_storage.hpp"
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <csignal>
+#include <pthread.h>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "SETTINGS.h"
+
+// Prediction server
+//
+// Loads the models once and answers requests, one per line:
+//
+//   request:  [request-id ]term:value term:value ...
+//   response: [request-id,]label label ...
+//
+// the same features as the test data, the response is a line of the
+// submission. ./predict_server reads stdin and writes stdout,
+// ./predict_server <path> listens on a Unix domain socket.
+//
+// The lines of all connections go to one queue. A batch thread takes up
+// to SERVER_BATCH_SIZE of them, waiting at most SERVER_BATCH_WAIT_US for
+// more after the first one, and predicts them together with all threads.
+//
+// A line longer than SERVER_MAX_LINE closes its connection. SIGINT or
+// SIGTERM stops the server: the connections are shut down and their
+// threads joined before the models are released.
+
+typedef struct request {
+	fv_t fv;
+	std::vector<int> labels;
+} request_t;
+
+static void
+predict_labels(std::vector<int> &results,
+			   ClassifierStorage::ScoreContext &context,
+			   const fv_t &query,
+			   const std::vector<int> &search_results,
+			   const ClassifierStorage &classifiers)
+{
+	std::vector<std::pair<float, int> > rank;
+
+	classifiers.predict(context, rank, search_results, query);
+	std::sort(rank.begin(), rank.end(),
+			  std::greater<std::pair<float, int> >());
+	for (auto i = rank.begin(); i != rank.end(); ++i) {
+		if (results.size() == 0 || i->first >= 0.0) {
+			results.push_back(i->second);
+		}
+	}
+}
+
+class Batcher
+{
+private:
+	const TFIDFTransformer &m_transformer;
+	const NearestCentroidClassifier &m_centroid;
+	const ClassifierStorage &m_classifiers;
+	std::vector<InvertedIndex::SearchContext> m_contexts;
+	std::vector<ClassifierStorage::ScoreContext> m_score_contexts;
+
+	std::mutex m_mutex;
+	std::condition_variable m_queued;
+	std::condition_variable m_done;
+	std::vector<request_t *> m_queue;
+	size_t m_finished; // requests predicted so far
+	size_t m_queued_total;
+	bool m_stop;
+
+	void
+	predict(std::vector<request_t *> &batch)
+	{
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+		for (int i = 0; i < (int)batch.size(); i += InvertedIndex::BATCH_SIZE) {
+			int n = std::min((int)batch.size() - i, (int)InvertedIndex::BATCH_SIZE);
+			int id = processor_id() % (int)m_contexts.size();
+			std::vector<fv_t> queries(n);
+			std::vector<std::vector<int> > results;
+
+			for (int j = 0; j < n; ++j) {
+				queries[j].swap(batch[i + j]->fv);
+				m_transformer.transform(queries[j]);
+			}
+			m_centroid.predict_batch(m_contexts[id], results, K_PREDICT, queries.data(), n);
+			for (int j = 0; j < n; ++j) {
+				predict_labels(batch[i + j]->labels, m_score_contexts[id],
+							   queries[j], results[j], m_classifiers);
+			}
+		}
+	}
+
+public:
+	Batcher(const TFIDFTransformer &transformer,
+			const NearestCentroidClassifier &centroid,
+			const ClassifierStorage &classifiers)
+		: m_transformer(transformer), m_centroid(centroid), m_classifiers(classifiers),
+		  m_contexts(thread_count()), m_score_contexts(thread_count()),
+		  m_finished(0), m_queued_total(0), m_stop(false)
+	{}
+
+	// predicts the requests, returns when all of them are done
+	void
+	submit(std::vector<request_t> &requests)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		size_t last;
+
+		for (auto request = requests.begin(); request != requests.end(); ++request) {
+			m_queue.push_back(&*request);
+		}
+		m_queued_total += requests.size();
+		last = m_queued_total;
+		m_queued.notify_one();
+		// requests are predicted in the order they are queued
+		while (m_finished < last) {
+			m_done.wait(lock);
+		}
+	}
+
+	void
+	stop(void)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_queued.notify_one();
+	}
+
+	void
+	run(void)
+	{
+		std::vector<request_t *> batch;
+
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				while (m_queue.empty() && !m_stop) {
+					m_queued.wait(lock);
+				}
+				if (m_queue.empty()) {
+					return;
+				}
+				// micro-batch: wait a little for more requests
+				auto deadline = std::chrono::steady_clock::now()
+					+ std::chrono::microseconds(SERVER_BATCH_WAIT_US);
+				while (m_queue.size() < SERVER_BATCH_SIZE && !m_stop) {
+					if (m_queued.wait_until(lock, deadline) == std::cv_status::timeout) {
+						break;
+					}
+				}
+				size_t n = std::min(m_queue.size(), (size_t)SERVER_BATCH_SIZE);
+				batch.assign(m_queue.begin(), m_queue.begin() + n);
+				m_queue.erase(m_queue.begin(), m_queue.begin() + n);
+			}
+			predict(batch);
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_finished += batch.size();
+				m_done.notify_all();
+			}
+		}
+	}
+};
+
+static bool
+write_all(int fd, const std::string &buffer)
+{
+	size_t done = 0;
+
+	while (done < buffer.size()) {
+		ssize_t n = write(fd, buffer.data() + done, buffer.size() - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		done += (size_t)n;
+	}
+	return true;
+}
+
+static void
+parse_request(const char *p, const char *end, request_t &request, std::string &request_id)
+{
+	const char *space = (const char *)std::memchr(p, ' ', end - p);
+	const char *colon = (const char *)std::memchr(p, ':', end - p);
+
+	request_id.clear();
+	if (space != 0 && (colon == 0 || space < colon)) {
+		request_id.assign(p, space);
+		p = space + 1;
+	}
+	DataReader::parse_features(p, end, request.fv);
+	fv_sort(request.fv);
+}
+
+// answers the lines of in on out. the lines read at once are
+// submitted together, so a client that sends many lines gets them
+// predicted in one batch.
+static void
+serve(Batcher &batcher, int in, int out)
+{
+	std::vector<char> buffer;
+	std::vector<request_t> requests;
+	std::vector<std::string> request_ids;
+	std::string response;
+	char chunk[65536];
+	bool eof = false;
+
+	while (!eof) {
+		ssize_t n = read(in, chunk, sizeof(chunk));
+		const char *p;
+		const char *end;
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			eof = true;
+			// the last line may have no newline
+			if (buffer.empty() || buffer.back() == '\n') {
+				break;
+			}
+			buffer.push_back('\n');
+		} else {
+			buffer.insert(buffer.end(), chunk, chunk + n);
+		}
+
+		requests.clear();
+		request_ids.clear();
+		p = buffer.data();
+		end = buffer.data() + buffer.size();
+		for (;;) {
+			const char *eol = (const char *)std::memchr(p, '\n', end - p);
+			const char *line_end;
+			if (eol == 0) {
+				break;
+			}
+			line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+			requests.push_back(request_t());
+			request_ids.push_back(std::string());
+			parse_request(p, line_end, requests.back(), request_ids.back());
+			p = eol + 1;
+		}
+		buffer.erase(buffer.begin(), buffer.begin() + (p - buffer.data()));
+		if (buffer.size() > SERVER_MAX_LINE) {
+			fprintf(stderr, "line longer than %d bytes, connection closed\n",
+					(int)SERVER_MAX_LINE);
+			break;
+		}
+		if (requests.empty()) {
+			continue;
+		}
+
+		batcher.submit(requests);
+		response.clear();
+		for (size_t i = 0; i < requests.size(); ++i) {
+			bool first = true;
+			if (!request_ids[i].empty()) {
+				response += request_ids[i];
+				response += ',';
+			}
+			for (auto l = requests[i].labels.begin(); l != requests[i].labels.end(); ++l) {
+				if (first) {
+					first = false;
+				} else {
+					response += ' ';
+				}
+				response += std::to_string(*l);
+			}
+			response += '\n';
+		}
+		if (!write_all(out, response)) {
+			break;
+		}
+	}
+}
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void
+on_stop_signal(int)
+{
+	g_stop = 1;
+}
+
+// SIGINT and SIGTERM go to the main thread only, so that they interrupt
+// its accept(). the other threads are started with them blocked.
+static void
+block_stop_signals(int how, sigset_t *old)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(how, &set, old);
+}
+
+// connection threads of the socket server. a finished thread shuts its
+// socket down, it is joined and the socket closed when the next
+// connection is added. stop() shuts down the open connections and joins
+// all threads.
+class Connections
+{
+private:
+	typedef struct connection {
+		std::thread thread;
+		int fd;
+		bool done;
+	} connection_t;
+	
+	std::mutex m_mutex;
+	std::list<connection_t> m_connections;
+	
+	void
+	reap(void)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto c = m_connections.begin();
+		while (c != m_connections.end()) {
+			if (c->done) {
+				c->thread.join();
+				close(c->fd);
+				c = m_connections.erase(c);
+			} else {
+				++c;
+			}
+		}
+	}
+	
+public:
+	void
+	add(Batcher &batcher, int fd)
+	{
+		reap();
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_connections.push_back(connection_t());
+		connection_t *c = &m_connections.back();
+		sigset_t old;
+		c->fd = fd;
+		c->done = false;
+		block_stop_signals(SIG_BLOCK, &old);
+		c->thread = std::thread([this, &batcher, c]() {
+			serve(batcher, c->fd, c->fd);
+			// the client sees the end now, the fd is closed by reap()
+			shutdown(c->fd, SHUT_RDWR);
+			std::unique_lock<std::mutex> lock(m_mutex);
+			c->done = true;
+		});
+		pthread_sigmask(SIG_SETMASK, &old, 0);
+	}
+	void
+	stop(void)
+	{
+		{
+			// the blocked reads return 0, serve() returns
+			std::unique_lock<std::mutex> lock(m_mutex);
+			for (auto c = m_connections.begin(); c != m_connections.end(); ++c) {
+				shutdown(c->fd, SHUT_RDWR);
+			}
+		}
+		for (auto c = m_connections.begin(); c != m_connections.end(); ++c) {
+			c->thread.join();
+			close(c->fd);
+		}
+		m_connections.clear();
+	}
+};
+
+static int
+listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (std::strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+		|| listen(fd, 64) != 0)
+	{
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	TFIDFTransformer transformer;
+	NearestCentroidClassifier centroid;
+	ClassifierStorage classifier_storage;
+	long t = tick();
+
+	if (!classifier_storage.load(MODEL)) {
+		fprintf(stderr, "cant open classifier storage\n");
+		return -1;
+	}
+	classifier_storage.build_term_index();
+	if (!transformer.load(WEIGHT) || !centroid.load(CENTROID)) {
+		fprintf(stderr, "cant open %s or %s\n", WEIGHT, CENTROID);
+		return -1;
+	}
+	centroid.set_maxscore(NCC_MAXSCORE != 0);
+	fprintf(stderr, "load %ldms\n", tick() - t);
+
+	Batcher batcher(transformer, centroid, classifier_storage);
+	sigset_t old;
+	block_stop_signals(SIG_BLOCK, &old);
+	std::thread batch_thread(&Batcher::run, &batcher);
+	pthread_sigmask(SIG_SETMASK, &old, 0);
+
+	signal(SIGPIPE, SIG_IGN);
+	if (argc < 2) {
+		serve(batcher, 0, 1);
+	} else {
+		Connections connections;
+		struct sigaction action;
+		int fd = listen_unix(argv[1]);
+		if (fd < 0) {
+			batcher.stop();
+			batch_thread.join();
+			return -1;
+		}
+		// no SA_RESTART, so accept() returns EINTR on the signal
+		std::memset(&action, 0, sizeof(action));
+		action.sa_handler = on_stop_signal;
+		sigaction(SIGINT, &action, 0);
+		sigaction(SIGTERM, &action, 0);
+		fprintf(stderr, "listening on %s\n", argv[1]);
+		while (!g_stop) {
+			int client = accept(fd, 0, 0);
+			if (client < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("accept");
+				break;
+			}
+			connections.add(batcher, client);
+		}
+		close(fd);
+		unlink(argv[1]);
+		connections.stop();
+	}
+	batcher.stop();
+	batch_thread.join();
+
+	return 0;
+}
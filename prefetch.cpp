@@ -1,13 +1,96 @@
 #include "util.hpp"
 #include "reader.hpp"
-#include "tick.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "memory_report.hpp"
 #include "tfidf_transformer.hpp"
 #include "evaluation.hpp"
 #include "nearest_centroid_classifier.hpp"
 #include "ncc_cache.hpp"
+#include "prefetch_checkpoint.hpp"
 #include <cstdio>
 #include "SETTINGS.h"
 
+// NCC results of data, in segments of PREFETCH_SEGMENT documents.
+// each finished segment is saved with a checkpoint, so a restarted
+// run continues after the last finished segment.
+static bool
+prefetch(NCCCache &cache,
+		 const char *cache_file,
+		 const NearestCentroidClassifier &centroid,
+		 const std::vector<fv_t> &data,
+		 const char *name,
+		 Metrics &metrics)
+{
+	PrefetchCheckpoint checkpoint(cache_file, data.size(), PREFETCH_SEGMENT, K_TRAIN,
+								  centroid.fingerprint(),
+								  fv_fingerprint(data.data(), data.size()));
+	size_t done = checkpoint.open();
+	
+	cache.resize(data.size(), K_TRAIN);
+	if (done > 0) {
+		printf("%s: resume %s at %ld/%ld\n", name, cache_file,
+			   (long)checkpoint.begin(done), data.size());
+	}
+	for (size_t s = 0; s < done; ++s) {
+		if (!checkpoint.load(s, cache)) {
+			fprintf(stderr, "%s: checkpoint of %s is broken, remove %s.manifest\n",
+					name, cache_file, cache_file);
+			return false;
+		}
+	}
+	for (size_t s = done; s < checkpoint.segments(); ++s) {
+		int begin = (int)checkpoint.begin(s);
+		int end = (int)checkpoint.end(s);
+		
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+		{
+			InvertedIndex::SearchContext context;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+			for (int i = begin; i < end; i += InvertedIndex::BATCH_SIZE) {
+				int n = std::min(end - i, (int)InvertedIndex::BATCH_SIZE);
+				std::vector<std::vector<int> > results;
+				
+				{
+					TraceSpan span("search batch", n);
+					Metrics::Timer timer(metrics, Metrics::SEARCH, n);
+					centroid.predict_batch(context, results, K_TRAIN, &data[i], n);
+				}
+				for (int j = 0; j < n; ++j) {
+					cache.set(i + j, results[j]);
+				}
+				if (i / 10000 != (i + n) / 10000) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+					{
+						printf("%s: %d/%ld\n", name, i, data.size());
+					}
+				}
+			}
+		}
+		TraceSpan span("checkpoint", end - begin);
+		Metrics::Timer timer(metrics, Metrics::OUTPUT, end - begin);
+		if (!checkpoint.save(s, cache)) {
+			fprintf(stderr, "%s: checkpoint of %s failed\n", name, cache_file);
+			return false;
+		}
+	}
+	TraceSpan span("NCCCache::save", data.size());
+	Metrics::Timer timer(metrics, Metrics::OUTPUT, data.size());
+	if (!cache.save(cache_file)) {
+		fprintf(stderr, "%s: cant write %s\n", name, cache_file);
+		return false;
+	}
+	checkpoint.remove();
+	
+	return true;
+}
+
 int main(int argc, char **argv)
 {
 	DataReader reader;
@@ -16,81 +99,99 @@ int main(int argc, char **argv)
 	NearestCentroidClassifier centroid;
 	TFIDFTransformer transformer;
 	category_index_t category_index;
-	long t = tick();
+	Metrics metrics;
+	uint64_t t;
 	NCCCache cache;
 #if VALIDATION_TEST	
 	NCCCache cache_test;
 	std::vector<fv_t> test_data;
 	std::vector<label_t> test_labels;
 #endif
+	auto print_memory = [&](const char *phase) {
+		MemoryReport report;
+		report.add("data", memory_usage(data));
+		report.add("labels", memory_usage(labels));
+#if VALIDATION_TEST
+		report.add("test data", memory_usage(test_data));
+		report.add("test labels", memory_usage(test_labels));
+		report.add("test ncc cache", cache_test.memory_usage());
+#endif
+		report.add("category index", memory_usage(category_index));
+		report.add("idf", transformer.memory_usage());
+		report.add("centroids", centroid.memory_usage());
+		report.add("ncc cache", cache.memory_usage());
+		report.print(stdout, argv[0], phase);
+	};
 	
+	if (TRACE) {
+		Trace::instance().open((std::string(argv[0]) + ".trace.json").c_str());
+	}
+	t = tick_ns();
 	if (!reader.open(TRAIN_DATA)) {
 		fprintf(stderr, "cant read file\n");
 		return -1;
 	}
-	reader.read(data, labels);
-	printf("read %ld, %ld, %ldms\n", data.size(), labels.size(), tick() - t);
+	{
+		TraceSpan span("read");
+		const CompiledDataset *compiled = reader.dataset();
+		// prefetch needs the labels for the category index only, which is
+		// built from a compiled file as it is mapped (the validation test
+		// needs them to split the data)
+		if (compiled != 0 && !VALIDATION_TEST) {
+			compiled->read(data);
+			compiled->build_category_index(category_index);
+		} else {
+			reader.read(data, labels);
+			build_category_index(category_index, data, labels);
+		}
+		span.set_items(data.size());
+	}
+	metrics.record(Metrics::PARSE, tick_ns() - t, data.size());
+	printf("read %ld, %ld categories\n", data.size(), category_index.size());
+	print_memory("read");
 	
 	reader.close();
 	
-	t = tick();
-	build_category_index(category_index, data, labels);
 #if VALIDATION_TEST
 	srand(VT_SEED);
 	split_data(test_data, test_labels, data, labels, category_index, 0.05);
 	build_category_index(category_index, data, labels);
 #endif
-	t = tick();
+	t = tick_ns();
 	transformer.train(data);
 	transformer.transform(data);
 #if VALIDATION_TEST
 	transformer.transform(test_data);
 #endif
+	metrics.record(Metrics::TRANSFORM, tick_ns() - t, data.size());
+	t = tick_ns();
 	centroid.train(category_index, data);
-	printf("build index %ldms\n", tick() -t );
-	t = tick();
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 1)
-#endif
-	for (int i = 0; i < (int)data.size(); ++i) {
-		std::vector<int> results;
-		
-		centroid.predict(results, K_TRAIN, data[i]);
-		cache.set(i, results);
-		if (i % 10000 == 0) {
-#ifdef _OPENMP
-#pragma omp critical
-#endif
-			{
-				printf("%s: %d/%ld %ldms\n", argv[0], i, data.size(), tick() - t);
-				t = tick();
-			}
-		}
+	centroid.set_maxscore(NCC_MAXSCORE != 0);
+	metrics.record(Metrics::BUILD, tick_ns() - t, centroid.size());
+	printf("build index %ld\n", centroid.size());
+	print_memory("build index");
+	if (!prefetch(cache, CACHE, centroid, data, argv[0], metrics)) {
+		return -1;
 	}
-	cache.save(CACHE);
-
 #if VALIDATION_TEST
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 1)
+	if (!prefetch(cache_test, CACHE_TEST, centroid, test_data, argv[0], metrics)) {
+		return -1;
+	}
 #endif
-	for (int i = 0; i < (int)test_data.size(); ++i) {
-		std::vector<int> results;
-		centroid.predict(results, K_TRAIN, test_data[i]);
-		cache_test.set(i, results);
-		if (i % 10000 == 0) {
-#ifdef _OPENMP
-#pragma omp critical
+	print_memory("prefetch");
+	t = tick_ns();
+	{
+		TraceSpan span("save", centroid.size());
+#if QUANTIZED_MODEL
+		centroid.quantize();
 #endif
-			{
-				printf("%s: %d/%ld %ldms\n", argv[0], i, test_data.size(), tick() - t);
-				t = tick();
-			}
-		}
+		centroid.save(CENTROID);
+		transformer.save(WEIGHT);
 	}
-	cache_test.save(CACHE_TEST);
-#endif
-	centroid.save(CENTROID);
-	transformer.save(WEIGHT);
+	metrics.record(Metrics::OUTPUT, tick_ns() - t, centroid.size());
+	
+	metrics.summary(stdout, argv[0], data.size());
+	Trace::instance().save();
 	
 	return 0;
 }
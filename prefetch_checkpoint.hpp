@@ -0,0 +1,199 @@
+#ifndef PREFETCH_CHECKPOINT_HPP
+#define PREFETCH_CHECKPOINT_HPP
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include "ncc_cache.hpp"
+
+// Checkpoint of a prefetch run
+//
+// The documents are processed in segments of segment_docs documents.
+// The rows of a finished segment are saved to <cache>.<segment>, then
+// the manifest <cache>.manifest records the number of finished segments.
+// Both are written to a temporary file, fsynced and renamed, and the
+// directory is fsynced after each rename, so a run killed at any point
+// (or a power loss) leaves the last finished segment readable.
+//
+// open() returns the segments to skip on restart. A manifest of a
+// different document count, segment size, k, model or data (by their
+// fingerprints) is ignored and the run starts over. load() checks that
+// a segment holds the rows the manifest expects.
+class PrefetchCheckpoint
+{
+private:
+	static const int VERSION = 2;
+
+	std::string m_cache_file;
+	size_t m_docs;
+	size_t m_segment_docs;
+	size_t m_k;
+	uint64_t m_model;
+	uint64_t m_data;
+
+	std::string
+	manifest_file(void) const
+	{
+		return m_cache_file + ".manifest";
+	}
+	std::string
+	segment_file(size_t segment) const
+	{
+		char suffix[32];
+		std::snprintf(suffix, sizeof(suffix), ".%06ld", (long)segment);
+		return m_cache_file + suffix;
+	}
+
+	static bool
+	sync_close(FILE *fp)
+	{
+		bool ok = std::fflush(fp) == 0;
+		ok &= fsync(fileno(fp)) == 0;
+		ok &= std::fclose(fp) == 0;
+		return ok;
+	}
+	static bool
+	sync_path(const char *path, int flags)
+	{
+		int fd = ::open(path, flags);
+		bool ok;
+		
+		if (fd < 0) {
+			return false;
+		}
+		ok = fsync(fd) == 0;
+		ok &= ::close(fd) == 0;
+		return ok;
+	}
+	// makes the renames in the directory of the cache durable
+	bool
+	sync_directory(void) const
+	{
+		size_t slash = m_cache_file.rfind('/');
+		std::string dir = slash == std::string::npos ? "." : m_cache_file.substr(0, slash + 1);
+		return sync_path(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	}
+
+	bool
+	write_manifest(size_t done) const
+	{
+		std::string tmp = manifest_file() + ".tmp";
+		FILE *fp = std::fopen(tmp.c_str(), "w");
+		bool ok = true;
+
+		if (fp == 0) {
+			return false;
+		}
+		ok &= std::fprintf(fp, "prefetch-checkpoint %d\n", VERSION) > 0;
+		ok &= std::fprintf(fp, "docs %ld\n", (long)m_docs) > 0;
+		ok &= std::fprintf(fp, "segment_docs %ld\n", (long)m_segment_docs) > 0;
+		ok &= std::fprintf(fp, "k %ld\n", (long)m_k) > 0;
+		ok &= std::fprintf(fp, "model %016llx\n", (unsigned long long)m_model) > 0;
+		ok &= std::fprintf(fp, "data %016llx\n", (unsigned long long)m_data) > 0;
+		ok &= std::fprintf(fp, "done %ld\n", (long)done) > 0;
+		ok &= sync_close(fp);
+
+		return ok && std::rename(tmp.c_str(), manifest_file().c_str()) == 0
+			&& sync_directory();
+	}
+
+public:
+	// model and data are fingerprints of the centroids and of the
+	// documents, see NearestCentroidClassifier::fingerprint()
+	PrefetchCheckpoint(const char *cache_file,
+					   size_t docs, size_t segment_docs, size_t k,
+					   uint64_t model, uint64_t data)
+		: m_cache_file(cache_file), m_docs(docs),
+		  m_segment_docs(segment_docs > 0 ? segment_docs : 1), m_k(k),
+		  m_model(model), m_data(data)
+	{}
+
+	size_t
+	segments(void) const
+	{
+		return (m_docs + m_segment_docs - 1) / m_segment_docs;
+	}
+	// documents of a segment are [begin(segment), end(segment))
+	size_t
+	begin(size_t segment) const
+	{
+		return segment * m_segment_docs;
+	}
+	size_t
+	end(size_t segment) const
+	{
+		return std::min(m_docs, (segment + 1) * m_segment_docs);
+	}
+
+	// number of finished segments
+	size_t
+	open(void) const
+	{
+		FILE *fp = std::fopen(manifest_file().c_str(), "r");
+		int version = 0;
+		long docs = 0, segment_docs = 0, k = 0, done = 0;
+		unsigned long long model = 0, data = 0;
+
+		if (fp == 0) {
+			return 0;
+		}
+		if (std::fscanf(fp, "prefetch-checkpoint %d docs %ld segment_docs %ld k %ld "
+						"model %llx data %llx done %ld",
+						&version, &docs, &segment_docs, &k, &model, &data, &done) != 7
+			|| version != VERSION)
+		{
+			std::fprintf(stderr, "PrefetchCheckpoint: %s: invalid format\n",
+						 manifest_file().c_str());
+			done = 0;
+		} else if ((size_t)docs != m_docs || (size_t)segment_docs != m_segment_docs
+				   || (size_t)k != m_k || model != m_model || data != m_data)
+		{
+			std::fprintf(stderr, "PrefetchCheckpoint: %s: other data or settings, ignored\n",
+						 manifest_file().c_str());
+			done = 0;
+		}
+		std::fclose(fp);
+
+		return std::min((size_t)std::max(done, 0L), segments());
+	}
+
+	// saves the rows of a finished segment, segments are finished in order
+	bool
+	save(size_t segment, const NCCCache &cache) const
+	{
+		std::string file = segment_file(segment);
+		std::string tmp = file + ".tmp";
+
+		// the segment must be on disk before the manifest names it
+		if (!cache.save(tmp.c_str(), begin(segment), end(segment))
+			|| !sync_path(tmp.c_str(), O_RDONLY)
+			|| std::rename(tmp.c_str(), file.c_str()) != 0
+			|| !sync_directory())
+		{
+			return false;
+		}
+		return write_manifest(segment + 1);
+	}
+
+	// reads the rows of a finished segment into cache
+	bool
+	load(size_t segment, NCCCache &cache) const
+	{
+		return cache.load_rows(segment_file(segment).c_str(),
+							   begin(segment), end(segment) - begin(segment));
+	}
+
+	// removes the segments and the manifest after the cache is saved
+	void
+	remove(void) const
+	{
+		for (size_t i = 0; i < segments(); ++i) {
+			std::remove(segment_file(i).c_str());
+		}
+		std::remove(manifest_file().c_str());
+	}
+};
+
+#endif
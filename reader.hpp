@@ -2,70 +2,312 @@
 #define READER_H
 
 #include "util.hpp"
-#include <fstream>
-#include <sstream>
+#include "mapped_file.hpp"
+#include "compiled_dataset.hpp"
+#include <cstring>
 
+// Parallel parser for the LSHTC format.
+// "label, label, ... id:value id:value ..."
+// Files written by ./compile_dataset are detected and mapped as they are.
+//
+// read() parses the whole file in parallel. read_chunk() returns the
+// documents in order, a chunk at a time, so that a large file can be
+// processed in bounded memory.
 class DataReader
 {
 private:
-	std::ifstream m_fp;
-	char m_buffer[1024 * 1024];
+	MappedFile m_file;
+	CompiledDataset m_dataset;
+	bool m_compiled;
+	// position of read_chunk(): the next line, or the next compiled row
+	const char *m_next;
+	size_t m_next_row;
+
+	static inline const char *
+	parse_int(const char *p, const char *end, int &value)
+	{
+		bool negative = false;
+		const char *digits;
+		int v = 0;
+
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = (*p == '-');
+			++p;
+		}
+		digits = p;
+		while (p < end && *p >= '0' && *p <= '9') {
+			v = v * 10 + (*p - '0');
+			++p;
+		}
+		if (p == digits) {
+			return 0;
+		}
+		value = negative ? -v : v;
+
+		return p;
+	}
+
+	static inline const char *
+	parse_float(const char *p, const char *end, float &value)
+	{
+		bool negative = false;
+		bool has_digits = false;
+		double v = 0.0;
+
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative = (*p == '-');
+			++p;
+		}
+		while (p < end && *p >= '0' && *p <= '9') {
+			v = v * 10.0 + (*p - '0');
+			has_digits = true;
+			++p;
+		}
+		if (p < end && *p == '.') {
+			double scale = 0.1;
+			++p;
+			while (p < end && *p >= '0' && *p <= '9') {
+				v += (*p - '0') * scale;
+				scale *= 0.1;
+				has_digits = true;
+				++p;
+			}
+		}
+		if (!has_digits) {
+			return 0;
+		}
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			int exponent;
+			const char *q = parse_int(p + 1, end, exponent);
+			if (q != 0) {
+				v *= std::pow(10.0, exponent);
+				p = q;
+			}
+		}
+		value = (float)(negative ? -v : v);
+
+		return p;
+	}
+
+	static void
+	parse_line(const char *p, const char *end,
+			   fv_t &fv, label_t &label)
+	{
+		const char *q;
+		int id;
+
+		// labels are separated by ", " and terminated by a space
+		for (;;) {
+			char sep;
+			if ((q = parse_int(p, end, id)) == 0 || q == end) {
+				return;
+			}
+			sep = *q;
+			p = q + 1;
+			label.insert(id);
+			if (sep != ',') {
+				break;
+			}
+			if (p < end && *p == ' ') {
+				++p;
+			}
+		}
+		parse_features(p, end, fv);
+	}
+
+	// parses the line at p, returns the next line
+	static const char *
+	parse_next(const char *p, const char *end,
+			   fv_t &buffer,
+			   std::vector<fv_t> &data,
+			   std::vector<label_t> &labels)
+	{
+		const char *eol = (const char *)std::memchr(p, '\n', end - p);
+		if (eol == 0) {
+			eol = end;
+		}
+		buffer.clear();
+		labels.push_back(label_t());
+		parse_line(p, eol, buffer, labels.back());
+		fv_sort(buffer);
+		data.push_back(fv_t(buffer.begin(), buffer.end()));
+		return eol + 1;
+	}
+
+	static void
+	parse_chunk(const char *p, const char *end,
+				std::vector<fv_t> &data,
+				std::vector<label_t> &labels)
+	{
+		fv_t buffer;
+
+		while (p < end) {
+			p = parse_next(p, end, buffer, data, labels);
+		}
+	}
+
+	// the first line after the header
+	const char *
+	first_line(void) const
+	{
+		const char *begin = m_file.data();
+		const char *end = begin + m_file.size();
+
+		if (begin == 0) {
+			return 0;
+		}
+		begin = (const char *)std::memchr(begin, '\n', end - begin);
+		return begin == 0 ? 0 : begin + 1;
+	}
+
+	// split [begin, end) into line aligned chunks
+	static void
+	split_lines(std::vector<const char *> &bounds,
+				const char *begin, const char *end,
+				size_t chunks)
+	{
+		size_t chunk_size = (end - begin) / chunks + 1;
+		const char *p = begin;
+
+		bounds.clear();
+		bounds.push_back(begin);
+		while (p < end) {
+			const char *eol;
+			p = (size_t)(end - p) > chunk_size ? p + chunk_size : end;
+			eol = (const char *)std::memchr(p, '\n', end - p);
+			p = (eol == 0) ? end : eol + 1;
+			bounds.push_back(p);
+		}
+	}
+
 public:
+	// "id:value id:value ...", appended to fv unsorted
+	static void
+	parse_features(const char *p, const char *end, fv_t &fv)
+	{
+		const char *q;
+		float value;
+		int id;
+
+		while (p < end) {
+			if ((q = parse_int(p, end, id)) == 0 || q + 1 >= end) {
+				break;
+			}
+			if ((q = parse_float(q + 1, end, value)) == 0) {
+				break;
+			}
+			fv.push_back(std::make_pair(id, value));
+			p = q < end ? q + 1 : end;
+		}
+	}
+
+	DataReader() : m_compiled(false), m_next(0), m_next_row(0) {}
+
 	bool
 	open(const char *file)
 	{
-		m_fp.open(file, std::ifstream::in);
-		if (!m_fp) {
+		if (!m_file.open(file, true)) {
 			return false;
 		}
-		m_fp.rdbuf()->pubsetbuf(m_buffer, sizeof(m_buffer));
-		
+		m_next_row = 0;
+		m_compiled = CompiledDataset::is_compiled(m_file.data(), m_file.size());
+		if (m_compiled) {
+			m_file.close();
+			m_next = 0;
+			return m_dataset.open(file);
+		}
+		m_next = first_line();
 		return true;
 	}
-	
+
+	// compiled dataset view, or 0 for text files
+	const CompiledDataset *
+	dataset(void) const
+	{
+		return m_compiled ? &m_dataset : 0;
+	}
+
 	void
 	read(std::vector<fv_t> &data,
 		 std::vector<label_t> &labels)
 	{
-		std::string line;
+		const char *begin = first_line();
+		const char *end = m_file.data() + m_file.size();
+		std::vector<const char *> bounds;
+
+		if (m_compiled) {
+			m_dataset.read(data, labels);
+			return;
+		}
 		data.clear();
 		labels.clear();
-		
-		getline(m_fp, line); // skip headeer
-		while (getline(m_fp, line)) {
-			std::istringstream is(line);
-			fv_t fv;
-			label_t label;
-			char sep;
-			float value;
-			int id;
-
-			is >> std::noskipws;
-			while (is >> id >> sep) {
-				if (sep == ',') {
-					label.insert(id);
-					is >> sep;
-					if (sep != ' ') {
-						is.putback(sep);
-					}
-				} else {
-					label.insert(id);
-					break;
-				}
+		if (begin == 0) {
+			return;
+		}
+
+		split_lines(bounds, begin, end, processor_count() * 16);
+
+		int chunks = (int)bounds.size() - 1;
+		std::vector<std::vector<fv_t> > chunk_data(chunks);
+		std::vector<std::vector<label_t> > chunk_labels(chunks);
+		std::vector<size_t> offsets(chunks + 1, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+		for (int i = 0; i < chunks; ++i) {
+			parse_chunk(bounds[i], bounds[i + 1], chunk_data[i], chunk_labels[i]);
+		}
+		for (int i = 0; i < chunks; ++i) {
+			offsets[i + 1] = offsets[i] + chunk_data[i].size();
+		}
+		data.resize(offsets[chunks]);
+		labels.resize(offsets[chunks]);
+
+		// concatenate results in order
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+		for (int i = 0; i < chunks; ++i) {
+			for (size_t j = 0; j < chunk_data[i].size(); ++j) {
+				data[offsets[i] + j].swap(chunk_data[i][j]);
+				labels[offsets[i] + j].swap(chunk_labels[i][j]);
 			}
-			while (is >> id >> sep >> value) {
-				fv.insert(std::make_pair(id, value));
-				is >> sep;
+		}
+	}
+
+	// reads the next max_docs documents (or less at the end of the file)
+	// in the calling thread. returns false when there are no more.
+	bool
+	read_chunk(std::vector<fv_t> &data,
+			   std::vector<label_t> &labels,
+			   size_t max_docs)
+	{
+		data.clear();
+		labels.clear();
+		if (m_compiled) {
+			size_t end = std::min(m_dataset.size(), m_next_row + max_docs);
+			m_dataset.read(data, labels, m_next_row, end);
+			m_next_row = end;
+		} else if (m_next != 0) {
+			const char *end = m_file.data() + m_file.size();
+			fv_t buffer;
+			
+			while (m_next < end && data.size() < max_docs) {
+				m_next = parse_next(m_next, end, buffer, data, labels);
 			}
-			data.push_back(fv);
-			labels.push_back(label);
 		}
+		return !data.empty();
 	}
-	
+
 	void
 	close(void)
 	{
-		m_fp.close();
+		m_next = 0;
+		m_next_row = 0;
+		m_file.close();
+		m_dataset.close();
+		m_compiled = false;
 	}
 };
 
@@ -0,0 +1,214 @@
+#include "sparse_kernels.hpp"
+#include <cstdio>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+// Accuracy of sparse_kernels.hpp against the scalar reference.
+// exits with 1 when an error is above the bound given in sparse_kernels.hpp.
+//
+//   make check
+
+static const double DOT_BOUND = 1.5e-7;     // relative to sum |w x|
+static const double I8_BOUND = 2.5e-7;      // relative to sum |w x|
+static const double EXP_BOUND = 8.2e-8;     // relative
+static const double SIGMOID_BOUND = 8.8e-8; // absolute
+
+static const int WORDS = 5000;
+static const int ROWS = 2000;
+static const size_t MAX_LENGTH = 70; // all remainders of 8 and 16
+
+static std::vector<sparse_element_t>
+random_row(std::mt19937 &rng, size_t n)
+{
+	std::uniform_int_distribution<int> word(0, WORDS - 1);
+	std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+	std::vector<int> ids;
+	std::vector<sparse_element_t> row;
+
+	// unique within the row (sparse_axpy requires it), but drawn from
+	// few words, so the rows share ids
+	while (ids.size() < n) {
+		int id = word(rng) % (int)(4 * MAX_LENGTH);
+		if (std::find(ids.begin(), ids.end(), id) == ids.end()) {
+			ids.push_back(id);
+		}
+	}
+	for (size_t i = 0; i < n; ++i) {
+		row.push_back(std::make_pair(ids[i], value(rng)));
+	}
+	return row;
+}
+
+static bool
+test_dot(std::mt19937 &rng)
+{
+	std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+	std::vector<float> w(WORDS);
+	double max_error = 0.0;
+
+	for (auto i = w.begin(); i != w.end(); ++i) {
+		*i = value(rng);
+	}
+	for (int r = 0; r < ROWS; ++r) {
+		size_t n = (size_t)r % (MAX_LENGTH + 1);
+		std::vector<sparse_element_t> row = random_row(rng, n);
+		double exact = 0.0, scale = 0.0;
+
+		for (size_t i = 0; i < n; ++i) {
+			exact += (double)w[row[i].first] * row[i].second;
+			scale += std::fabs((double)w[row[i].first] * row[i].second);
+		}
+		if (scale == 0.0) {
+			continue;
+		}
+		float fast = sparse_dot(w.data(), row.data(), n);
+		float scalar = sparse_dot_scalar(w.data(), row.data(), n);
+		max_error = std::max(max_error, std::fabs(fast - exact) / scale);
+		max_error = std::max(max_error, std::fabs((double)fast - scalar) / scale);
+	}
+	printf("sparse_dot    max error %.3e (bound %.1e)\n", max_error, DOT_BOUND);
+	return max_error <= DOT_BOUND;
+}
+
+// w has exactly the ids of the rows, so that the blocks with an id in the
+// last 3 bytes of w take the scalar path
+static bool
+test_dot_i8(std::mt19937 &rng)
+{
+	std::uniform_int_distribution<int> weight(-127, 127);
+	std::vector<int8_t> w(4 * MAX_LENGTH);
+	double max_error = 0.0;
+
+	for (auto i = w.begin(); i != w.end(); ++i) {
+		*i = (int8_t)weight(rng);
+	}
+	for (int r = 0; r < ROWS; ++r) {
+		size_t n = (size_t)r % (MAX_LENGTH + 1);
+		std::vector<sparse_element_t> row = random_row(rng, n);
+		double exact = 0.0, scale = 0.0;
+
+		for (size_t i = 0; i < n; ++i) {
+			exact += (double)w[row[i].first] * row[i].second;
+			scale += std::fabs((double)w[row[i].first] * row[i].second);
+		}
+		if (scale == 0.0) {
+			continue;
+		}
+		float fast = sparse_dot_i8(w.data(), w.size(), row.data(), n);
+		float scalar = sparse_dot_i8_scalar(w.data(), row.data(), n);
+		max_error = std::max(max_error, std::fabs(fast - exact) / scale);
+		max_error = std::max(max_error, std::fabs((double)fast - scalar) / scale);
+	}
+	printf("sparse_dot_i8 max error %.3e (bound %.1e)\n", max_error, I8_BOUND);
+	return max_error <= I8_BOUND;
+}
+
+// the rows are terms of a term index: rows are models, slot maps a
+// model to its score or -1. each score is compared with the exact sum
+static bool
+test_scatter_i8(std::mt19937 &rng)
+{
+	std::uniform_int_distribution<int> weight(-127, 127);
+	std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+	const int models = 4 * (int)MAX_LENGTH;
+	std::vector<int32_t> slot(models, -1);
+	std::vector<float> fast, scalar;
+	std::vector<double> exact, scale;
+	double max_error = 0.0;
+
+	for (int m = 0; m < models; m += 2) {
+		slot[m] = (int32_t)fast.size();
+		fast.push_back(0.0f);
+	}
+	scalar = fast;
+	exact.assign(fast.size(), 0.0);
+	scale.assign(fast.size(), 0.0);
+	for (int r = 0; r < ROWS; ++r) {
+		size_t n = (size_t)r % (MAX_LENGTH + 1);
+		std::vector<sparse_element_t> row = random_row(rng, n);
+		std::vector<int32_t> rows;
+		std::vector<int8_t> w;
+		float a = value(rng);
+
+		for (size_t i = 0; i < n; ++i) {
+			rows.push_back(row[i].first);
+			w.push_back((int8_t)weight(rng));
+			if (slot[rows[i]] >= 0) {
+				exact[slot[rows[i]]] += (double)a * w[i];
+				scale[slot[rows[i]]] += std::fabs((double)a * w[i]);
+			}
+		}
+		sparse_scatter_add_i8(fast.data(), slot.data(), rows.data(), w.data(), a, n);
+		sparse_scatter_add_i8_scalar(scalar.data(), slot.data(), rows.data(), w.data(), a, n);
+	}
+	for (size_t k = 0; k < fast.size(); ++k) {
+		if (scale[k] > 0.0) {
+			max_error = std::max(max_error, std::fabs(fast[k] - exact[k]) / scale[k]);
+			max_error = std::max(max_error, std::fabs((double)fast[k] - scalar[k]) / scale[k]);
+		}
+	}
+	printf("sparse_scatter_add_i8 max error %.3e (bound %.1e)\n", max_error, I8_BOUND);
+	return max_error <= I8_BOUND;
+}
+
+// the rows are added to the same w one after another
+static bool
+test_axpy(std::mt19937 &rng)
+{
+	std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+	std::vector<float> fast(WORDS), scalar(WORDS);
+	size_t mismatches = 0;
+
+	for (int i = 0; i < WORDS; ++i) {
+		fast[i] = scalar[i] = value(rng);
+	}
+	for (int r = 0; r < ROWS; ++r) {
+		size_t n = (size_t)r % (MAX_LENGTH + 1);
+		std::vector<sparse_element_t> row = random_row(rng, n);
+		float a = value(rng);
+
+		sparse_axpy(fast.data(), a, row.data(), n);
+		sparse_axpy_scalar(scalar.data(), a, row.data(), n);
+	}
+	for (int i = 0; i < WORDS; ++i) {
+		if (fast[i] != scalar[i]) {
+			mismatches += 1;
+		}
+	}
+	printf("sparse_axpy   %ld mismatches\n", (long)mismatches);
+	return mismatches == 0;
+}
+
+static bool
+test_exp(void)
+{
+	double max_exp = 0.0, max_sigmoid = 0.0;
+
+	for (float x = -87.0f; x <= 88.0f; x += 0.001f) {
+		double exact = std::exp((double)x);
+		max_exp = std::max(max_exp, std::fabs(fast_exp(x) - exact) / exact);
+		max_sigmoid = std::max(max_sigmoid,
+							   std::fabs(fast_sigmoid(x) - 1.0 / (1.0 + std::exp(-(double)x))));
+	}
+	printf("fast_exp      max error %.3e (bound %.1e)\n", max_exp, EXP_BOUND);
+	printf("fast_sigmoid  max error %.3e (bound %.1e)\n", max_sigmoid, SIGMOID_BOUND);
+	return max_exp <= EXP_BOUND && max_sigmoid <= SIGMOID_BOUND;
+}
+
+int main(void)
+{
+	std::mt19937 rng(1);
+	bool ok = true;
+
+	ok &= test_dot(rng);
+	ok &= test_axpy(rng);
+	ok &= test_dot_i8(rng);
+	ok &= test_scatter_i8(rng);
+	ok &= test_exp();
+	printf("%s\n", ok ? "ok" : "FAILED");
+
+	return ok ? 0 : 1;
+}
@@ -1,6 +1,7 @@
 #ifndef TFIDF_TRANSFORMER_HPP
 #define TFIDF_TRANSFORMER_HPP
 #include "util.hpp"
+#include "trace.hpp"
 #include <cstdio>
 
 class TFIDFTransformer
@@ -18,6 +19,7 @@ public:
 	{
 		static const float BETA = 5.0f;
 		double docs = (double)tf.size();
+		TraceSpan span("TFIDFTransformer::train", tf.size());
 		
 		// word count
 		m_idf.clear();
@@ -63,6 +65,7 @@ public:
 	void
 	transform(std::vector<fv_t> &tf) const
 	{
+		TraceSpan span("TFIDFTransformer::transform", tf.size());
 #ifdef _OPENMP
 #pragma omp parallel for
 #endif
@@ -71,6 +74,12 @@ public:
 		}
 	}
 
+	// heap bytes of the idf table
+	size_t
+	memory_usage(void) const
+	{
+		return ::memory_usage(m_idf);
+	}
 	bool
 	save(const char *file) const
 	{
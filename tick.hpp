@@ -1,6 +1,7 @@
 #ifndef TICK_H
 #define TICK_H
 
+#include <stdint.h>
 #if (defined(_WIN32) || defined(_WIN64))
 #  include <windows.h>
 #else
@@ -8,19 +9,27 @@
 #  include <sys/time.h>
 #endif
 
-static unsigned long
-tick(void)
+// monotonic clock in nanoseconds, for intervals only
+static inline uint64_t
+tick_ns(void)
 {
-#if (defined(_WIN32) || defined(_WIN64))	
-	return (unsigned long)GetTickCount();
+#if (defined(_WIN32) || defined(_WIN64))
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t)((double)count.QuadPart * 1.0e9 / frequency.QuadPart);
 #else
-	unsigned long c;
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	c = tv.tv_sec * 1000;
-	c += tv.tv_usec / 1000;
-	return c;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 #endif
 }
 
+// milliseconds
+static unsigned long
+tick(void)
+{
+	return (unsigned long)(tick_ns() / 1000000ULL);
+}
+
 #endif
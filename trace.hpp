@@ -0,0 +1,137 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <stdint.h>
+#include "util.hpp"
+#include "tick.hpp"
+
+// Trace of the pipeline phases in the Chrome trace event format
+// (chrome://tracing, https://ui.perfetto.dev).
+//
+// TraceSpan records a complete event ("ph":"X") from its construction
+// to its destruction, with ThreadSlot::id() as tid (the OpenMP thread
+// number is 0 in every std::thread and nested team). Nothing is
+// recorded until Trace::instance().open() is called; a disabled span
+// costs one branch. Spans are buffered per thread (no lock) and written
+// by save(), which must not run concurrently with them.
+class Trace
+{
+private:
+	typedef struct event {
+		const char *name;   // a string literal
+		uint64_t begin;
+		uint64_t end;
+		uint64_t items;
+		int tid;
+	} event_t;
+
+	bool m_enabled;
+	std::string m_file;
+	uint64_t m_start;
+	ThreadBuffer<event_t> m_events;
+
+	Trace() : m_enabled(false), m_start(0) {}
+	Trace(const Trace &);
+	Trace &operator=(const Trace &);
+
+public:
+	static Trace &
+	instance(void)
+	{
+		static Trace trace;
+		return trace;
+	}
+
+	inline bool
+	enabled(void) const
+	{
+		return m_enabled;
+	}
+
+	// starts recording, the events are written to file by save()
+	void
+	open(const char *file)
+	{
+		m_file = file;
+		m_start = tick_ns();
+		m_enabled = true;
+	}
+
+	inline void
+	add(const char *name, uint64_t begin, uint64_t end, uint64_t items)
+	{
+		event_t e;
+		e.name = name;
+		e.begin = begin;
+		e.end = end;
+		e.items = items;
+		e.tid = ThreadSlot::id();
+		m_events.push_back(e);
+	}
+
+	bool
+	save(void)
+	{
+		std::vector<event_t> events;
+		bool ok = true;
+
+		if (!m_enabled) {
+			return true;
+		}
+		m_events.drain(events);
+		FILE *fp = std::fopen(m_file.c_str(), "w");
+		if (fp == 0) {
+			std::fprintf(stderr, "Trace: cant write %s\n", m_file.c_str());
+			return false;
+		}
+		ok &= std::fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n") > 0;
+		for (size_t i = 0; i < events.size(); ++i) {
+			const event_t &e = events[i];
+			ok &= std::fprintf(fp,
+							   "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+							   "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"items\":%lu}}\n",
+							   i == 0 ? "" : ",",
+							   e.name, e.tid,
+							   (e.begin - m_start) * 1.0e-3,
+							   (e.end - e.begin) * 1.0e-3,
+							   (unsigned long)e.items) > 0;
+		}
+		ok &= std::fprintf(fp, "]}\n") > 0;
+		ok &= std::fclose(fp) == 0;
+
+		return ok;
+	}
+};
+
+class TraceSpan
+{
+private:
+	const char *m_name;
+	uint64_t m_begin;
+	uint64_t m_items;
+
+	TraceSpan(const TraceSpan &);
+	TraceSpan &operator=(const TraceSpan &);
+
+public:
+	explicit TraceSpan(const char *name, uint64_t items = 0)
+		: m_name(name),
+		  m_begin(Trace::instance().enabled() ? tick_ns() : 0),
+		  m_items(items)
+	{}
+	~TraceSpan()
+	{
+		if (m_begin != 0) {
+			Trace::instance().add(m_name, m_begin, tick_ns(), m_items);
+		}
+	}
+	void
+	set_items(uint64_t items)
+	{
+		m_items = items;
+	}
+};
+
+#endif
@@ -1,15 +1,51 @@
 #include "util.hpp"
 #include "reader.hpp"
-#include "tick.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "memory_report.hpp"
 #include "tfidf_transformer.hpp"
 #include "evaluation.hpp"
 #include "ncc_cache.hpp"
 #include "binary_classifier.hpp"
 #include "classifier_storage.hpp"
+#include "multi_class_trainer.hpp"
 #include <cstdio>
 #include <map>
 #include "SETTINGS.h"
 
+// writes the iterations of each class to path, one "category iterations"
+// line per class, and prints the average and the slowest class
+void
+print_iterations(const char *path,
+				 const std::vector<std::pair<double, int> > &category_data,
+				 const std::vector<size_t> &class_iterations)
+{
+	FILE *fp = fopen(path, "w");
+	size_t total = 0;
+	size_t slowest = 0;
+	
+	if (fp == 0) {
+		fprintf(stderr, "open failed: %s\n", path);
+	}
+	for (size_t i = 0; i < category_data.size(); ++i) {
+		if (fp) {
+			fprintf(fp, "%d %ld\n", category_data[i].second, class_iterations[i]);
+		}
+		total += class_iterations[i];
+		if (class_iterations[i] > class_iterations[slowest]) {
+			slowest = i;
+		}
+	}
+	if (fp) {
+		fclose(fp);
+	}
+	if (!category_data.empty()) {
+		printf("train %ld classes, %.2f iterations/class, max %ld (category %d), per class: %s\n",
+			   category_data.size(), (double)total / category_data.size(),
+			   class_iterations[slowest], category_data[slowest].second, path);
+	}
+}
+
 void
 build_train_data(category_index_t &dataset,
 				 std::vector<fv_t> &data,
@@ -44,9 +80,8 @@ build_train_data(category_index_t &dataset,
 void
 get_train_data(
 	int target,
-	std::vector<fv_t> &posi,
-	std::vector<fv_t> &nega,
-	const std::vector<fv_t> &test_data,
+	std::vector<int> &posi,
+	std::vector<int> &nega,
 	const std::vector<label_t> &test_labels,
 	const category_index_t &dataset)
 {
@@ -59,14 +94,52 @@ get_train_data(
 	}
 	for (auto i = target_dataset->second.begin(); i != target_dataset->second.end(); ++i) {
 		if (test_labels[*i].find(target) != test_labels[*i].end()) {
-			posi.push_back(test_data[*i]);
+			posi.push_back(*i);
 		} else {
-			nega.push_back(test_data[*i]);
+			nega.push_back(*i);
 		}
 	}
 }
 
-int main(void)
+void
+train_classifier(BinaryClassifier &model,
+				 const std::vector<fv_t> &data,
+				 const std::vector<int> &posi,
+				 const std::vector<int> &nega,
+				 int threads)
+{
+#if LR_SOLVER == 1
+	model.train_dual(data, posi, nega, LR_P, LR_DUAL_C, LR_DUAL_EPS, LR_DUAL_ITERATION);
+#else
+	model.train(data, posi, nega, LR_ETA, LR_P, LR_ITERATION, threads);
+#endif
+}
+
+// estimated SGD cost of a class: examples x average nnz x iterations
+double
+train_cost(int target,
+		   const std::vector<fv_t> &data,
+		   const category_index_t &dataset)
+{
+	auto target_dataset = dataset.find(target);
+	double nnz = 0.0;
+	
+	if (target_dataset == dataset.end()) {
+		return 0.0;
+	}
+	for (auto i = target_dataset->second.begin(); i != target_dataset->second.end(); ++i) {
+		nnz += data[*i].size();
+	}
+	return nnz * LR_ITERATION;
+}
+
+static bool
+cost_greater(const std::pair<double, int> &a, const std::pair<double, int> &b)
+{
+	return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+int main(int argc, char **argv)
 {
 	DataReader reader;	
 	std::vector<fv_t> data;
@@ -78,69 +151,163 @@ int main(void)
 	TFIDFTransformer transformer;
 	category_index_t category_index;
 	category_index_t dataset;
-	long t = tick();
+	Metrics metrics;
+	uint64_t t;
 	NCCCache cache;
 	ClassifierStorage classifiers;
+	auto print_memory = [&](const char *phase) {
+		MemoryReport report;
+		report.add("data", memory_usage(data));
+		report.add("labels", memory_usage(labels));
+#if VALIDATION_TEST
+		report.add("test data", memory_usage(test_data));
+		report.add("test labels", memory_usage(test_labels));
+#endif
+		report.add("category index", memory_usage(category_index));
+		report.add("dataset", memory_usage(dataset));
+		report.add("ncc cache", cache.memory_usage());
+		report.add("idf", transformer.memory_usage());
+		report.add("classifiers", classifiers.memory_usage());
+		report.print(stdout, argv[0], phase);
+	};
 	
+	if (TRACE) {
+		Trace::instance().open((std::string(argv[0]) + ".trace.json").c_str());
+	}
+	t = tick_ns();
 	if (!reader.open(TRAIN_DATA)) {
 		fprintf(stderr, "cant read file\n");
 		return -1;
 	}
-	reader.read(data, labels);
-	printf("read %ld, %ld, %ldms\n", data.size(), labels.size(), tick() - t);
-	reader.close();
+	{
+		TraceSpan span("read");
+		reader.read(data, labels);
+		reader.close();
+		span.set_items(data.size());
+	}
 	
-	if (!cache.load(CACHE)) {
-		std::fprintf(stderr, "load failed: %s: please either run ./vt_prefetch\n", CACHE);
-		return -1;
+	{
+		TraceSpan span("NCCCache::load");
+		if (!cache.load(CACHE)) {
+			std::fprintf(stderr, "load failed: %s: please either run ./vt_prefetch\n", CACHE);
+			return -1;
+		}
 	}
-	printf("read %ld, %ld, %ldms\n", data.size(), labels.size(), tick() - t);
+	metrics.record(Metrics::PARSE, tick_ns() - t, data.size());
+	printf("read %ld, %ld\n", data.size(), labels.size());
+	print_memory("read");
 	
-	t = tick();
 	build_category_index(category_index, data, labels);
 #if VALIDATION_TEST
 	srand(VT_SEED);
 	split_data(test_data, test_labels, data, labels, category_index, 0.05f);
 	build_category_index(category_index, data, labels);
 #endif
+	t = tick_ns();
 	transformer.load(WEIGHT);
 	transformer.transform(data);
+	metrics.record(Metrics::TRANSFORM, tick_ns() - t, data.size());
 	
-	printf("build index %ldms\n", tick() -t );
-	t = tick();
-	
-	build_train_data(dataset, data, labels, cache);
-	printf("build dataset %ld %ldms\n", dataset.size(), tick() -t );
+	t = tick_ns();
+	{
+		TraceSpan span("build dataset", data.size());
+		build_train_data(dataset, data, labels, cache);
+	}
+	metrics.record(Metrics::BUILD, tick_ns() - t, data.size());
+	printf("build dataset %ld\n", dataset.size());
+	print_memory("build dataset");
 
-	std::vector<std::pair<int, const std::vector<int> *> > category_data;
+#if LR_ENGINE == 1 && LR_SOLVER == 0
+	std::vector<int> targets;
+	MultiClassTrainer trainer;
 	for (auto docs = category_index.begin(); docs != category_index.end(); ++docs) {
-		category_data.push_back(std::make_pair(docs->first, &docs->second));
+		targets.push_back(docs->first);
 	}
-	std::random_shuffle(category_data.begin(), category_data.end());
+	{
+		TraceSpan span("MultiClassTrainer::train", targets.size());
+		Metrics::Timer timer(metrics, Metrics::TRAIN, targets.size());
+		trainer.train(classifiers, targets, data, labels, dataset,
+					  LR_ETA, LR_P, LR_ITERATION, LR_BLOCK_NNZ);
+	}
+#else
+	// the largest classes first, so the small ones fill the cores at the end.
+	// a class above the threshold would leave one core running long after
+	// the others are done, so it is trained with all threads instead.
+	// The two phases are sequential: the large classes are trained one
+	// after another, each with all threads (Hogwild, not deterministic),
+	// and the parallel loop over the small classes starts after the last
+	// of them. Small classes do not run next to a large one.
+	std::vector<std::pair<double, int> > category_data;
+	double total_cost = 0.0;
+	for (auto docs = category_index.begin(); docs != category_index.end(); ++docs) {
+		double cost = train_cost(docs->first, data, dataset);
+		category_data.push_back(std::make_pair(cost, docs->first));
+		total_cost += cost;
+	}
+	std::sort(category_data.begin(), category_data.end(), cost_greater);
+	
+	int threads = thread_count();
+	double threshold = total_cost / (threads * LR_PARALLEL_SHARE);
+	std::vector<size_t> class_iterations(category_data.size(), 0);
+	int large = 0;
+	// dual coordinate descent has no parallel mode
+	while (LR_SOLVER == 0 && threads > 1
+		   && large < (int)category_data.size()
+		   && category_data[large].first > threshold)
+	{
+		large += 1;
+	}
+	printf("schedule %d parallel classes, %ld classes\n", large, category_data.size());
+	
+	for (int i = 0; i < large; ++i) {
+		TraceSpan span("train class (all threads)", 1);
+		Metrics::Timer timer(metrics, Metrics::TRAIN);
+		std::vector<int> posi;
+		std::vector<int> nega;
+		BinaryClassifier model;
+		
+		get_train_data(category_data[i].second, posi, nega, labels, dataset);
+		train_classifier(model, data, posi, nega, threads);
+		classifiers.set(category_data[i].second, model);
+		class_iterations[i] = model.iterations();
+	}
+	printf("- train %d/%ld\n", large, category_data.size());
 	
 #ifdef _OPENMP
 #pragma omp parallel for schedule(dynamic, 1)
 #endif
-	for (int i = 0; i < (int)category_data.size(); ++i) {
+	for (int i = large; i < (int)category_data.size(); ++i) {
 		if (i % 10000 == 0) {
 #ifdef _OPENMP
 #pragma omp critical
 #endif
 			{
-				printf("- train %d/%ld %ldms\n",
-					   i, category_data.size(), tick() - t);
-				t = tick();
+				printf("- train %d/%ld\n", i, category_data.size());
 			}
 		}
-		std::vector<fv_t> posi;
-		std::vector<fv_t> nega;
+		TraceSpan span("train class", 1);
+		Metrics::Timer timer(metrics, Metrics::TRAIN);
+		std::vector<int> posi;
+		std::vector<int> nega;
 		BinaryClassifier model;
 		
-		get_train_data(category_data[i].first, posi, nega, data, labels, dataset);
-		model.train(posi, nega, LR_ETA, LR_P, LR_ITERATION);
-		classifiers.set(category_data[i].first, model);
+		get_train_data(category_data[i].second, posi, nega, labels, dataset);
+		train_classifier(model, data, posi, nega, 1);
+		classifiers.set(category_data[i].second, model);
+		class_iterations[i] = model.iterations();
 	}
-	classifiers.save(MODEL);
+	print_iterations(ITERATION_LOG, category_data, class_iterations);
+#endif
+	print_memory("train");
+	t = tick_ns();
+	{
+		TraceSpan span("ClassifierStorage::save");
+		classifiers.save(MODEL, QUANTIZED_MODEL != 0);
+	}
+	metrics.record(Metrics::OUTPUT, tick_ns() - t, classifiers.size());
+	
+	metrics.summary(stdout, argv[0], data.size());
+	Trace::instance().save();
 	
 	return 0;
 }
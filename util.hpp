@@ -9,15 +9,88 @@
 #include <algorithm>
 #include <functional>
 #include <cfloat>
+#include <cstring>
+#include <stdint.h>
+#include <mutex>
 
 #ifdef _OPENMP
 #  include <omp.h>
 #endif
 
-typedef std::map<int, float> fv_t;
+// sparse feature vector, sorted by term id
+typedef std::vector<std::pair<int, float> > fv_t;
 typedef std::set<int> label_t;
 typedef std::map<int, std::vector<int> > category_index_t;
 
+// Memory footprint
+//
+// memory_usage() is the heap memory held by a container, as glibc malloc
+// allocates it on 64-bit (8 bytes chunk header, 16-byte granularity, 32
+// bytes minimum). std::map/std::set nodes count the tree node header.
+// The classes add their own memory_usage(); mapped files count with their
+// size, since their pages are in the RSS once read.
+static inline size_t
+heap_bytes(size_t n)
+{
+	return n == 0 ? 0 : std::max((size_t)32, (n + 8 + 15) & ~(size_t)15);
+}
+static inline size_t
+tree_node_bytes(size_t value_size)
+{
+	// color and parent/left/right pointers, then the value
+	return heap_bytes(4 * sizeof(void *) + value_size);
+}
+// vectors of trivially copyable elements
+template<typename T>
+static inline size_t
+memory_usage(const std::vector<T> &vec)
+{
+	return heap_bytes(vec.capacity() * sizeof(T));
+}
+template<typename T>
+static inline size_t
+memory_usage(const std::vector<std::vector<T> > &vec)
+{
+	size_t bytes = heap_bytes(vec.capacity() * sizeof(std::vector<T>));
+	for (auto v = vec.begin(); v != vec.end(); ++v) {
+		bytes += heap_bytes(v->capacity() * sizeof(T));
+	}
+	return bytes;
+}
+static inline size_t
+memory_usage(const label_t &label)
+{
+	return label.size() * tree_node_bytes(sizeof(int));
+}
+static inline size_t
+memory_usage(const std::vector<fv_t> &data)
+{
+	size_t bytes = heap_bytes(data.capacity() * sizeof(fv_t));
+	for (auto fv = data.begin(); fv != data.end(); ++fv) {
+		bytes += memory_usage(*fv);
+	}
+	return bytes;
+}
+static inline size_t
+memory_usage(const std::vector<label_t> &labels)
+{
+	size_t bytes = heap_bytes(labels.capacity() * sizeof(label_t));
+	for (auto label = labels.begin(); label != labels.end(); ++label) {
+		bytes += memory_usage(*label);
+	}
+	return bytes;
+}
+static inline size_t
+memory_usage(const category_index_t &index)
+{
+	size_t bytes = 0;
+	for (auto docs = index.begin(); docs != index.end(); ++docs) {
+		bytes += tree_node_bytes(sizeof(category_index_t::value_type));
+		bytes += memory_usage(docs->second);
+	}
+	return bytes;
+}
+
 static inline int
 processor_count(void)
 {
@@ -38,6 +111,173 @@ processor_id(void)
 #endif
 }
 
+static inline int
+thread_count(void)
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+// A small id per live thread, OpenMP or not. omp_get_thread_num() is
+// not unique under nested teams or in std::threads (all of them are 0).
+// The ids of finished threads are reused, so they stay below the number
+// of threads alive at once.
+class ThreadSlot
+{
+private:
+	int m_id;
+	
+	static std::mutex &
+	lock(void)
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+	static std::vector<int> &
+	free_ids(void)
+	{
+		static std::vector<int> ids;
+		return ids;
+	}
+	
+	ThreadSlot()
+	{
+		static int next_id = 0;
+		std::lock_guard<std::mutex> guard(lock());
+		if (free_ids().empty()) {
+			m_id = next_id++;
+		} else {
+			m_id = free_ids().back();
+			free_ids().pop_back();
+		}
+	}
+	~ThreadSlot()
+	{
+		std::lock_guard<std::mutex> guard(lock());
+		free_ids().push_back(m_id);
+	}
+	
+public:
+	static inline int
+	id(void)
+	{
+		static thread_local ThreadSlot slot;
+		return slot.m_id;
+	}
+};
+
+// Per-thread append buffers for parallel loops.
+// Each thread appends to its own buffer (by ThreadSlot) without locking;
+// threads beyond the count at construction share a locked one. The owner
+// merges them once no thread appends any more.
+template<typename T>
+class ThreadBuffer
+{
+private:
+	typedef struct buffer {
+		std::vector<T> data;
+		char padding[64]; // keep the buffers on separate cache lines
+	} buffer_t;
+	std::vector<buffer_t> m_buffers;
+	std::mutex m_overflow;
+	
+public:
+	ThreadBuffer() : m_buffers(thread_count() + 1) {}
+	
+	inline void
+	push_back(const T &value)
+	{
+		size_t id = (size_t)ThreadSlot::id();
+		if (id + 1 < m_buffers.size()) {
+			m_buffers[id].data.push_back(value);
+		} else {
+			// more threads than at construction
+			std::lock_guard<std::mutex> guard(m_overflow);
+			m_buffers.back().data.push_back(value);
+		}
+	}
+	bool
+	empty(void) const
+	{
+		for (auto buffer = m_buffers.begin(); buffer != m_buffers.end(); ++buffer) {
+			if (!buffer->data.empty()) {
+				return false;
+			}
+		}
+		return true;
+	}
+	// element_bytes(value) is the memory held by a value besides sizeof(T)
+	template<typename F>
+	size_t
+	memory_usage(F element_bytes) const
+	{
+		size_t bytes = heap_bytes(m_buffers.capacity() * sizeof(buffer_t));
+		for (auto buffer = m_buffers.begin(); buffer != m_buffers.end(); ++buffer) {
+			bytes += heap_bytes(buffer->data.capacity() * sizeof(T));
+			for (auto value = buffer->data.begin(); value != buffer->data.end(); ++value) {
+				bytes += element_bytes(*value);
+			}
+		}
+		return bytes;
+	}
+	// moves the values of all threads to out and clears the buffers
+	void
+	drain(std::vector<T> &out)
+	{
+		out.clear();
+		for (auto buffer = m_buffers.begin(); buffer != m_buffers.end(); ++buffer) {
+			out.insert(out.end(), buffer->data.begin(), buffer->data.end());
+			std::vector<T>().swap(buffer->data);
+		}
+	}
+};
+
+static inline bool
+fv_id_less(const std::pair<int, float> &a, const std::pair<int, float> &b)
+{
+	return a.first < b.first;
+}
+
+static inline bool
+fv_id_equal(const std::pair<int, float> &a, const std::pair<int, float> &b)
+{
+	return a.first == b.first;
+}
+
+// sort by term id and drop duplicated ids (the first one wins)
+static inline void
+fv_sort(fv_t &fv)
+{
+	if (!std::is_sorted(fv.begin(), fv.end(), fv_id_less)) {
+		std::stable_sort(fv.begin(), fv.end(), fv_id_less);
+	}
+	fv.erase(std::unique(fv.begin(), fv.end(), fv_id_equal), fv.end());
+}
+
+// 64-bit FNV-1a of feature vectors (ids and value bits), to tell
+// whether files were made from the same data
+static inline uint64_t
+fv_fingerprint_add(uint64_t h, uint64_t word)
+{
+	return (h ^ word) * 1099511628211ULL;
+}
+static inline uint64_t
+fv_fingerprint(const fv_t *rows, size_t n, uint64_t h = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < n; ++i) {
+		h = fv_fingerprint_add(h, rows[i].size());
+		for (auto x = rows[i].begin(); x != rows[i].end(); ++x) {
+			uint32_t bits;
+			std::memcpy(&bits, &x->second, sizeof(bits));
+			h = fv_fingerprint_add(h, ((uint64_t)(uint32_t)x->first << 32) | bits);
+		}
+	}
+	return h;
+}
+
 static void
 build_category_index(category_index_t &index,
 					 const std::vector<fv_t> &data,
@@ -81,10 +321,7 @@ shuffle_data(std::vector<fv_t> &data,
 {
 	for (size_t i = 0; i < data.size(); ++i) {
 		size_t rand_i = rand_index(data.size());
-		fv_t tmp1;
-		tmp1 = data[i];
-		data[i] = data[rand_i];
-		data[rand_i] = tmp1;
+		data[i].swap(data[rand_i]);
 		
 		label_t tmp2;
 		std::copy(labels[i].begin(), labels[i].end(),
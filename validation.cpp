@@ -1,6 +1,7 @@
 #include "util.hpp"
 #include "reader.hpp"
-#include "tick.hpp"
+#include "metrics.hpp"
+#include "memory_report.hpp"
 #include "tfidf_transformer.hpp"
 #include "evaluation.hpp"
 #include "classifier_storage.hpp"
@@ -10,25 +11,16 @@
 
 static void
 predict_labels(std::vector<int> &results,
+			   ClassifierStorage::ScoreContext &context,
 			   const fv_t &query,
 			   const std::vector<int> &search_results,
-			   ClassifierStorage &classifiers)
+			   const ClassifierStorage &classifiers)
 {
-	std::vector<int> candidate_labels;
-	std::vector<std::pair<double, int> > rank;
+	std::vector<std::pair<float, int> > rank;
 	
-	for (auto doc = search_results.begin(); doc != search_results.end(); ++doc) {
-		candidate_labels.push_back(*doc);
-	}
-	for (int i = 0; i < (int)candidate_labels.size(); ++i) {
-		const BinaryClassifier *classifier = classifiers.get(candidate_labels[i]);
-		if (classifier != 0) {
-			float value = classifier->predict(query);
-			rank.push_back(std::make_pair(value, candidate_labels[i]));
-		}
-	}
+	classifiers.predict(context, rank, search_results, query);
 	std::sort(rank.begin(), rank.end(),
-			  std::greater<std::pair<double, int> >());
+			  std::greater<std::pair<float, int> >());
 	for (auto i = rank.begin(); i != rank.end(); ++i) {
 		if (results.size() == 0 || i->first >= 0.0) {
 			results.push_back(i->second);
@@ -37,18 +29,65 @@ predict_labels(std::vector<int> &results,
 }
 
 static void
-print_evaluation(const Evaluation &evaluation, int i, long t)
+print_evaluation(const Evaluation &evaluation, int i)
 {
 	double maf, map, mar, top1_acc;
 	evaluation.score(maf, map, mar, top1_acc);
 	
-	printf("--- %d MaF: %f, MaP:%f, MaR:%f, Top1ACC: %f %ldms\n",
+	printf("--- %d MaF: %f, MaP:%f, MaR:%f, Top1ACC: %f\n",
 		   i,
-		   maf, map, mar, top1_acc,
-		   tick() -t);
+		   maf, map, mar, top1_acc);
+}
+
+static double
+evaluate(Evaluation &evaluation,
+		 const std::vector<fv_t> &test_data,
+		 const std::vector<label_t> &test_labels,
+		 const NearestCentroidClassifier &centroid,
+		 const ClassifierStorage &classifier_storage,
+		 Metrics &metrics)
+{
+	double maf, map, mar, top1_acc;
+	
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		InvertedIndex::SearchContext context;
+		ClassifierStorage::ScoreContext score_context;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+		for (int i = 0; i < (int)test_data.size(); ++i) {
+			std::vector<int> topn_labels;
+			std::vector<int> results;		
+			{
+				Metrics::Timer timer(metrics, Metrics::SEARCH);
+				centroid.predict(context, results, K_PREDICT, test_data[i]);
+			}
+			{
+				Metrics::Timer timer(metrics, Metrics::SCORE);
+				predict_labels(topn_labels, score_context, test_data[i], results, classifier_storage);
+			}
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+			{
+				evaluation.update(topn_labels, test_labels[i]);
+				if (i % 1000 == 0) {
+					print_evaluation(evaluation, i);
+				}
+			}
+		}
+	}
+	printf("----\n");
+	print_evaluation(evaluation, test_data.size());
+	evaluation.score(maf, map, mar, top1_acc);
+	
+	return maf;
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
 	DataReader reader;	
 	std::vector<fv_t> data;
@@ -59,9 +98,21 @@ int main(void)
 	ClassifierStorage classifier_storage;
 	NearestCentroidClassifier centroid;
 	TFIDFTransformer transformer;
-	long t = tick();
-	long t_all = tick();	
+	Metrics metrics;
+	uint64_t t = tick_ns();
 	Evaluation evaluation;
+	auto print_memory = [&](const char *phase) {
+		MemoryReport report;
+		report.add("data", memory_usage(data));
+		report.add("labels", memory_usage(labels));
+		report.add("test data", memory_usage(test_data));
+		report.add("test labels", memory_usage(test_labels));
+		report.add("category index", memory_usage(category_index));
+		report.add("idf", transformer.memory_usage());
+		report.add("centroids", centroid.memory_usage());
+		report.add("classifiers", classifier_storage.memory_usage());
+		report.print(stdout, argv[0], phase);
+	};
 
 	if (!reader.open(TRAIN_DATA)) {
 		fprintf(stderr, "cant read file\n");
@@ -71,47 +122,55 @@ int main(void)
 		fprintf(stderr, "cant open classifier storage\n");
 		return -1;
 	}
+	classifier_storage.build_term_index();
+	metrics.record(Metrics::BUILD, tick_ns() - t, classifier_storage.size());
+	t = tick_ns();
 	reader.read(data, labels);
 	reader.close();
+	metrics.record(Metrics::PARSE, tick_ns() - t, data.size());
 	
-	printf("read %ld, %ld, %ldms\n", data.size(), labels.size(), tick() - t);
+	printf("read %ld, %ld\n", data.size(), labels.size());
 	
-	t = tick();
 	build_category_index(category_index, data, labels);
 	srand(VT_SEED);
 	split_data(test_data, test_labels, data, labels, category_index, 0.05f);
 	build_category_index(category_index, data, labels);
 	printf("split train:%ld, test:%ld\n", data.size(), test_data.size());
+	print_memory("read");
 	
-	t = tick();
+	t = tick_ns();
 	transformer.load(WEIGHT);
 	transformer.transform(data);
 	transformer.transform(test_data);
+	metrics.record(Metrics::TRANSFORM, tick_ns() - t, data.size() + test_data.size());
+	t = tick_ns();
 	centroid.load(CENTROID);
-	printf("build index %ldms\n", tick() -t );
+	centroid.set_maxscore(NCC_MAXSCORE != 0);
+	metrics.record(Metrics::BUILD, tick_ns() - t, centroid.size());
+	print_memory("load");
 	
-	t = tick();
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 1)	
-#endif
-	for (int i = 0; i < (int)test_data.size(); ++i) {
-		std::vector<int> topn_labels;
-		std::vector<int> results;		
-		centroid.predict(results, K_PREDICT, test_data[i]);
-		predict_labels(topn_labels, test_data[i], results, classifier_storage);
-#ifdef _OPENMP
-#pragma omp critical
-#endif
-		{
-			evaluation.update(topn_labels, test_labels[i]);
-			if (i % 1000 == 0) {
-				print_evaluation(evaluation, i, t);
-				t = tick();
-			}
-		}
+	double maf = evaluate(evaluation, test_data, test_labels, centroid, classifier_storage, metrics);
+	print_memory("evaluate");
+	metrics.summary(stdout, argv[0], test_data.size());
+#if QUANTIZED_REPORT
+	if (!classifier_storage.quantized() || !centroid.quantized()) {
+		Evaluation quantized_evaluation;
+		Metrics quantized_metrics;
+		
+		t = tick_ns();
+		classifier_storage.quantize();
+		centroid.quantize();
+		quantized_metrics.record(Metrics::BUILD, tick_ns() - t, centroid.size());
+		double quantized_maf = evaluate(quantized_evaluation, test_data, test_labels,
+										centroid, classifier_storage, quantized_metrics);
+		printf("MaF float: %f, quantized: %f, delta: %f\n",
+			   maf, quantized_maf, quantized_maf - maf);
+		quantized_metrics.summary(stdout, "quantized", test_data.size());
+		print_memory("quantized evaluate");
 	}
-	printf("----\n");
-	print_evaluation(evaluation, test_data.size(), t_all);
+#else
+	(void)maf;
+#endif
 	
 	return 0;
 }
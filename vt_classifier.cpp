@@ -46,9 +46,8 @@ build_train_data(unsigned int k,
 void
 get_train_data(
 	int target,
-	std::vector<fv_t> &posi,
-	std::vector<fv_t> &nega,
-	const std::vector<fv_t> &test_data,
+	std::vector<int> &posi,
+	std::vector<int> &nega,
 	const std::vector<label_t> &test_labels,
 	const category_index_t &dataset)
 {
@@ -61,13 +60,27 @@ get_train_data(
 	}
 	for (auto i = target_dataset->second.begin(); i != target_dataset->second.end(); ++i) {
 		if (test_labels[*i].find(target) != test_labels[*i].end()) {
-			posi.push_back(test_data[*i]);
+			posi.push_back(*i);
 		} else {
-			nega.push_back(test_data[*i]);
+			nega.push_back(*i);
 		}
 	}
 }
 
+void
+train_classifier(BinaryClassifier &model,
+				 const std::vector<fv_t> &data,
+				 const std::vector<int> &posi,
+				 const std::vector<int> &nega,
+				 int threads)
+{
+#if LR_SOLVER == 1
+	model.train_dual(data, posi, nega, LR_P, LR_DUAL_C, LR_DUAL_EPS, LR_DUAL_ITERATION);
+#else
+	model.train(data, posi, nega, LR_ETA, LR_P, LR_ITERATION, threads);
+#endif
+}
+
 int
 main(void)
 {
@@ -134,28 +147,28 @@ main(void)
 	for (auto i = category_index.begin(); i != category_index.end(); ++i) {
 		long tt = tick();
 		// learning classifier each labels
-		std::vector<fv_t> posi;
-		std::vector<fv_t> nega;
-		std::vector<fv_t> test_posi;
-		std::vector<fv_t> test_nega;
+		std::vector<int> posi;
+		std::vector<int> nega;
+		std::vector<int> test_posi;
+		std::vector<int> test_nega;
 
 		if (i->second.size() < 2) {
 			continue;
 		}
-		get_train_data(i->first, posi, nega, data, labels, dataset);
-		get_train_data(i->first, test_posi, test_nega, test_data, test_labels, test_dataset);
+		get_train_data(i->first, posi, nega, labels, dataset);
+		get_train_data(i->first, test_posi, test_nega, test_labels, test_dataset);
 		BinaryClassifier model;
-		model.train(posi, nega, LR_ETA, LR_P, LR_ITERATION);
+		train_classifier(model, data, posi, nega, 1);
 		{
 			int correct_posi = 0;
 			int correct_nega = 0;
-			std::vector<fv_t> *instance[2] = {&test_nega, &test_posi};
+			std::vector<int> *instance[2] = {&test_nega, &test_posi};
 			for (int k = 0; k < 2; ++k) {
 				for (auto j = instance[k]->begin();
 					 j != instance[k]->end();
 					 ++j)
 				{
-					float p = model.predict(*j);
+					float p = model.predict(test_data[*j]);
 					if (p > 0.0f) {
 						if (k == 1) {
 							correct_posi += 1;
@@ -187,9 +200,10 @@ main(void)
 				nega_acc += (float)correct_nega/test_nega.size();
 			}
 			test_count += 1;
-			printf("label %08d: Non zero feature: %ld, accuracy nega:%f%% (%ld), posi:%f%% (%ld) %ldms\n",
+			printf("label %08d: Non zero feature: %ld, iterations: %ld, accuracy nega:%f%% (%ld), posi:%f%% (%ld) %ldms\n",
 				   i->first,
 				   model.size(),
+				   model.iterations(),
 				   (float)correct_nega / test_nega.size(),
 				   test_nega.size(),
 				   (float)correct_posi / test_posi.size(),
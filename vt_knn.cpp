@@ -13,6 +13,9 @@
 #define K              12
 #define K_FIRST        3000
 #define PREDICT_LABEL  5
+#ifndef COMPRESSED
+#  define COMPRESSED   0  /* 1 = compressed posting lists (8-bit values, results may change) */
+#endif
 
 static void
 predict(std::vector<int> &results,
@@ -92,29 +95,35 @@ int main(void)
 	tfidf.train(data);
 	tfidf.transform(data);
 	tfidf.transform(test_data);
-	knn.build(&data);
+	knn.build(&data, COMPRESSED != 0);
 	printf("build index %ldms\n", tick() -t );
 	
 	t = tick();
 	
 #ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 1)
+#pragma omp parallel
+#endif
+	{
+		InvertedIndex::SearchContext context;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
 #endif
-	for (int i = 0; i < (int)test_data.size(); ++i) {
-		std::vector<int> topn_labels;
-		InvertedIndex::result_t results;
-		
-		knn.fast_knn(results, K, test_data[i], K_FIRST, data.size() / 100);
-		predict(topn_labels, results, labels);
-		
+		for (int i = 0; i < (int)test_data.size(); ++i) {
+			std::vector<int> topn_labels;
+			InvertedIndex::result_t results;
+			
+			knn.fast_knn(context, results, K, test_data[i], K_FIRST, data.size() / 100);
+			predict(topn_labels, results, labels);
+			
 #ifdef _OPENMP
 #pragma omp critical
 #endif
-		{
-			evaluation.update(topn_labels, test_labels[i]);
-			if (i % 1000 == 0) {
-				print_evaluation(evaluation, i, t);
-				t = tick();
+			{
+				evaluation.update(topn_labels, test_labels[i]);
+				if (i % 1000 == 0) {
+					print_evaluation(evaluation, i, t);
+					t = tick();
+				}
 			}
 		}
 	}
@@ -24,6 +24,46 @@ print_evaluation(const Evaluation &evaluation, int i, long t)
 		   tick() -t);
 }
 
+static double
+evaluate(Evaluation &evaluation,
+		 const std::vector<fv_t> &test_data,
+		 const std::vector<label_t> &test_labels,
+		 const NearestCentroidClassifier &centroid_classifier)
+{
+	double maf, map, mar, top1_acc;
+	long t = tick();
+	long t_all = tick();
+	
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		InvertedIndex::SearchContext context;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+		for (int i = 0; i < (int)test_data.size(); ++i) {
+			std::vector<int> topn_labels;
+			centroid_classifier.predict(context, topn_labels, K, test_data[i]);
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+			{
+				evaluation.update(topn_labels, test_labels[i]);
+				if (i % 1000 == 0) {
+					print_evaluation(evaluation, i, t);
+					t = tick();
+				}
+			}
+		}
+	}
+	printf("----\n");
+	print_evaluation(evaluation, test_data.size(), t_all);
+	evaluation.score(maf, map, mar, top1_acc);
+	
+	return maf;
+}
+
 int
 main(void)
 {
@@ -36,7 +76,6 @@ main(void)
 	NearestCentroidClassifier centroid_classifier;
 	TFIDFTransformer tfidf;
 	long t = tick();
-	long t_all = tick();
 	Evaluation evaluation;
 	
 	if (!reader.open(TRAIN_DATA)) {
@@ -59,28 +98,22 @@ main(void)
 	tfidf.transform(data);
 	tfidf.transform(test_data);
 	centroid_classifier.train(category_index, data);
+	centroid_classifier.set_maxscore(NCC_MAXSCORE != 0);
 	printf("build index %ldms\n", tick() -t );
 	
+	double maf = evaluate(evaluation, test_data, test_labels, centroid_classifier);
+#if QUANTIZED_REPORT
+	// the same search on the compressed index (8-bit values)
+	Evaluation quantized_evaluation;
 	t = tick();
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 1)	
+	centroid_classifier.quantize();
+	printf("quantize %ldms\n", tick() - t);
+	double quantized_maf = evaluate(quantized_evaluation, test_data, test_labels, centroid_classifier);
+	printf("MaF float: %f, quantized: %f, delta: %f\n",
+		   maf, quantized_maf, quantized_maf - maf);
+#else
+	(void)maf;
 #endif
-	for (int i = 0; i < (int)test_data.size(); ++i) {
-		std::vector<int> topn_labels;
-		centroid_classifier.predict(topn_labels, K, test_data[i]);
-#ifdef _OPENMP
-#pragma omp critical
-#endif
-		{
-			evaluation.update(topn_labels, test_labels[i]);
-			if (i % 1000 == 0) {
-				print_evaluation(evaluation, i, t);
-				t = tick();
-			}
-		}
-	}
-	printf("----\n");
-	print_evaluation(evaluation, test_data.size(), t_all);
 	
 	return 0;
 }